@@ -3,20 +3,52 @@
 // by Abraham Stolk.
 // This software is in the Public Domain.
 
+#if defined(__linux__) && !defined(_DEFAULT_SOURCE)
+#	define _DEFAULT_SOURCE	// MAP_ANONYMOUS and madvise(), next to the Makefile's _POSIX_C_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <math.h>
+#include <limits.h>
+#include <signal.h>
+#include <errno.h>
+
+#if !defined(_WIN64)
+#	include <fcntl.h>
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#	include <time.h>
+#	include <unistd.h>
+#endif
 
 #if defined(_WIN64)
 #	define STBI_NO_SIMD
+#else
+#	define STBI_THREADS
+#	include <pthread.h>
 #endif
+// The decoders allocate from an arena that is recycled from image to image.
+static void* arena_alloc( size_t size );
+static void* arena_realloc( void* p, size_t size );
+static void arena_free( void* p );
+#define STBI_MALLOC(sz)		arena_alloc( sz )
+#define STBI_REALLOC(p,newsz)	arena_realloc( p, newsz )
+#define STBI_FREE(p)		arena_free( p )
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
 static int termw=0, termh=0;
 static int doubleres=0;
 static int blend=0;
+static int verbose=0;
+static long long maxmemory = 1024LL << 20;	// --max-memory, in bytes; 0 for no limit
+static int play=0;		// --play: animate GIFs instead of showing the first frame
+static int loops=0;		// --loops: times to play an animation; 0 for until interrupted
+static float exposure=0.0f;	// --exposure: stops to brighten HDR images by
+static float displaygamma=2.2f;	// --gamma: display gamma for HDR images
+static volatile sig_atomic_t interrupted=0;	// Ctrl-C during playback
 static unsigned char termbg[3] = { 0,0,0 };
 
 #if defined(_WIN64)
@@ -42,6 +74,23 @@ static void set_console_mode(void)
 	SetConsoleCP( 437 );
 	doubleres = 1;
 }
+static long long now_ms(void)
+{
+	return (long long) GetTickCount64();
+}
+static long long now_us(void)
+{
+	LARGE_INTEGER count, freq;
+	QueryPerformanceCounter( &count );
+	QueryPerformanceFrequency( &freq );
+	return count.QuadPart * 1000000 / freq.QuadPart;
+}
+static void sleep_until( long long deadline )
+{
+	const long long wait = deadline - now_ms();
+	if ( wait > 0 )
+		Sleep( (DWORD) wait );
+}
 #else
 static void get_terminal_size(void)
 {
@@ -59,40 +108,247 @@ static void set_console_mode()
 {
 	doubleres=1;
 }
+static long long now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+static long long now_us(void)
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+// Returns early if a signal comes in, so Ctrl-C is handled without delay.
+static void sleep_until( long long deadline )
+{
+	const long long wait = deadline - now_ms();
+	if ( wait > 0 )
+	{
+		const struct timespec ts = { (time_t) ( wait / 1000 ), (long) ( wait % 1000 ) * 1000000 };
+		nanosleep( &ts, 0 );
+	}
+}
 #endif
 
 
+// The arena behind STBI_MALLOC. Freed blocks go onto a free list per size
+// class instead of back to the system, so the next image of a similar size
+// decodes without any system allocations. arena_reset() runs between images
+// and returns the blocks the last image did not use. Big blocks are mapped
+// separately and, on Linux, backed by transparent huge pages.
+#define ARENA_CLASSES	240	// enough for any size below SIZE_MAX / 2
+#define ARENA_HUGE	( 2 << 20 )
+
+typedef struct arenablock
+{
+	struct arenablock* next;	// on its free list
+	size_t size;			// usable bytes after the header
+	int cls;
+	int mapped;
+	unsigned epoch;			// the last image that used it
+} arenablock_t;
+
+#define ARENA_HEADER	( ( sizeof( arenablock_t ) + 15 ) & ~(size_t) 15 )
+
+typedef struct
+{
+	arenablock_t* free[ ARENA_CLASSES ];
+	unsigned epoch;
+	long long held;			// bytes in blocks, free or in use
+	int allocs;			// this image: requests,
+	int fresh;			// ... of which the system served
+} arena_t;
+
+static arena_t arena;
+
+#if defined(STBI_THREADS)
+static pthread_mutex_t arenalock = PTHREAD_MUTEX_INITIALIZER;
+#	define ARENA_LOCK()	pthread_mutex_lock( &arenalock )
+#	define ARENA_UNLOCK()	pthread_mutex_unlock( &arenalock )
+#else
+#	define ARENA_LOCK()
+#	define ARENA_UNLOCK()
+#endif
+
+
+// Size classes are a quarter of a power of two apart (64, 80, 96, 112, 128,
+// 160, ...) so a block is never more than 25% bigger than asked for.
+static int arena_class( size_t size, size_t* rounded )
+{
+	int b = 5;
+	if ( size < 64 )
+		size = 64;
+	while ( ( (size_t) 2 << b ) < size )
+		++b;
+	const size_t step = (size_t) 1 << ( b - 2 );
+	*rounded = ( size + step - 1 ) & ~( step - 1 );
+	return ( b - 6 ) * 4 + (int) ( *rounded >> ( b - 2 ) ) - 4;
+}
+
+
+static arenablock_t* arena_system_alloc( size_t total )
+{
+#if defined(MAP_ANONYMOUS)
+	if ( total >= ARENA_HUGE )
+	{
+		void* p = mmap( 0, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+		if ( p == MAP_FAILED )
+			return 0;
+#	if defined(MADV_HUGEPAGE)
+		madvise( p, total, MADV_HUGEPAGE );
+#	endif
+		( (arenablock_t*) p )->mapped = 1;
+		return (arenablock_t*) p;
+	}
+#endif
+	arenablock_t* b = (arenablock_t*) malloc( total );
+	if ( b )
+		b->mapped = 0;
+	return b;
+}
+
+
+static void arena_system_free( arenablock_t* b )
+{
+	arena.held -= b->size;
+#if defined(MAP_ANONYMOUS)
+	if ( b->mapped )
+	{
+		munmap( b, ARENA_HEADER + b->size );
+		return;
+	}
+#endif
+	free( b );
+}
+
+
+static void* arena_alloc( size_t size )
+{
+	size_t rounded;
+	if ( size > (size_t) -1 / 2 )
+		return 0;
+	const int cls = arena_class( size, &rounded );
+	ARENA_LOCK();
+	arena.allocs++;
+	arenablock_t* b = arena.free[ cls ];
+	if ( b )
+		arena.free[ cls ] = b->next;
+	else if ( ( b = arena_system_alloc( ARENA_HEADER + rounded ) ) )
+	{
+		b->size = rounded;
+		b->cls = cls;
+		arena.held += rounded;
+		arena.fresh++;
+	}
+	if ( b )
+		b->epoch = arena.epoch;
+	ARENA_UNLOCK();
+	return b ? (char*) b + ARENA_HEADER : 0;
+}
+
+
+static void arena_free( void* p )
+{
+	if ( !p )
+		return;
+	arenablock_t* b = (arenablock_t*) ( (char*) p - ARENA_HEADER );
+	ARENA_LOCK();
+	b->next = arena.free[ b->cls ];
+	arena.free[ b->cls ] = b;
+	ARENA_UNLOCK();
+}
+
+
+static void* arena_realloc( void* p, size_t size )
+{
+	if ( !p )
+		return arena_alloc( size );
+	const arenablock_t* b = (const arenablock_t*) ( (char*) p - ARENA_HEADER );
+	if ( size <= b->size )
+		return p;
+	void* q = arena_alloc( size );
+	if ( !q )
+		return 0;
+	memcpy( q, p, b->size );
+	arena_free( p );
+	return q;
+}
+
+
+// Called after each image: gives the blocks that image left unused back to
+// the system, and with --verbose, reports how the decode was served.
+static void arena_reset( void )
+{
+	ARENA_LOCK();
+	for ( int i=0; i<ARENA_CLASSES; ++i )
+	{
+		arenablock_t** link = &arena.free[ i ];
+		while ( *link )
+		{
+			arenablock_t* b = *link;
+			if ( b->epoch == arena.epoch )
+				link = &b->next;
+			else
+			{
+				*link = b->next;
+				arena_system_free( b );
+			}
+		}
+	}
+	if ( verbose && arena.allocs )
+		fprintf( stderr, "  arena: %d allocation%s, %d from the system, %lld MB held.\n",
+			arena.allocs, arena.allocs == 1 ? "" : "s", arena.fresh, ( arena.held + ( 1 << 20 ) - 1 ) >> 20 );
+	arena.epoch++;
+	arena.allocs = 0;
+	arena.fresh = 0;
+	ARENA_UNLOCK();
+}
+
+
 
 #define RESETALL  "\x1b[0m"
 
 
-static void print_image_single_res( int w, int h, unsigned char* data )
+// Escape codes for a whole image are collected here and written with a single
+// fwrite, so a frame never reaches the terminal half drawn.
+typedef struct
 {
-	const int linesz = 16384;
-	char line[ linesz ];
-	unsigned char* reader = data;
+	char* data;
+	size_t size;
+	size_t cap;
+} textbuf_t;
 
-	for ( int y=0; y<h; ++y )
+
+static void tb_append( textbuf_t* tb, const char* s, size_t len )
+{
+	if ( tb->size + len > tb->cap )
 	{
-		line[0] = 0;
-		for ( int x=0; x<w; ++x )
+		size_t cap = tb->cap ? tb->cap : 1<<16;
+		while ( cap < tb->size + len )
+			cap *= 2;
+		char* grown = (char*) realloc( tb->data, cap );
+		if ( !grown )
 		{
-			strncat( line, "\x1b[48;2;", sizeof(line) - strlen(line) - 1 );
-			char tripl[80];
-			unsigned char r = *reader++;
-			unsigned char g = *reader++;
-			unsigned char b = *reader++;
-			unsigned char a = *reader++;
-			(void) a;
-			snprintf( tripl, sizeof(tripl), "%d;%d;%dm ", r,g,b );
-			strncat( line, tripl, sizeof(line) - strlen(line) - 1 );
+			fprintf( stderr, "Out of memory.\n" );
+			exit( 1 );
 		}
-		strncat( line, RESETALL, sizeof(line) - strlen(line) - 1 );
-		puts( line );
+		tb->data = grown;
+		tb->cap = cap;
 	}
-	assert( reader = data + w * h * 4 );
+	memcpy( tb->data + tb->size, s, len );
+	tb->size += len;
 }
 
+
+static void tb_puts( textbuf_t* tb, const char* line )
+{
+	tb_append( tb, line, strlen( line ) );
+	tb_append( tb, "\n", 1 );
+}
+
+
 #if defined(_WIN64)
 #	define HALFBLOCK "\xdf"		// Uses IBM PC Codepage 437 char 223
 #else
@@ -109,77 +365,620 @@ static void print_image_single_res( int w, int h, unsigned char* data )
 	b = ( b * t0 + termbg[2] * t1 ) / 255; \
 }
 
-static void print_image_double_res( int w, int h, unsigned char* data )
+// Escape codes for one character cell into buf, which must hold CELLSZ bytes;
+// returns their length. In double resolution, the cell is an upper half block
+// in the colour of the top pixel over the colour of the bottom one. Otherwise
+// bottom is unused and the cell is a space in the colour of the top pixel.
+#define CELLSZ 80
+static int format_cell( char* buf, const unsigned char* top, const unsigned char* bottom, int doblend )
 {
-	if ( h & 1 )
-		h--;
-	const int linesz = 32768;
-	char line[ linesz ];
+	unsigned char r = top[0];
+	unsigned char g = top[1];
+	unsigned char b = top[2];
+	unsigned char a = top[3];
+	if ( !doubleres )
+		return snprintf( buf, CELLSZ, "\x1b[48;2;%d;%d;%dm ", r,g,b );
+
+	// foreground colour.
+	if ( doblend )
+		BLEND
+	int len = snprintf( buf, CELLSZ, "\x1b[38;2;%d;%d;%dm", r,g,b );
+	// background colour.
+	r = bottom[0];
+	g = bottom[1];
+	b = bottom[2];
+	a = bottom[3];
+	if ( doblend )
+		BLEND
+	len += snprintf( buf+len, CELLSZ-len, "\x1b[48;2;%d;%d;%dm" HALFBLOCK, r,g,b );
+	return len;
+}
+
 
+static void print_image_single_res( textbuf_t* tb, int w, int h, unsigned char* data )
+{
+	char cell[ CELLSZ ];
+	for ( int y=0; y<h; ++y )
+	{
+		const unsigned char* row = data + y * w * 4;
+		for ( int x=0; x<w; ++x )
+			tb_append( tb, cell, format_cell( cell, row + x * 4, 0, 0 ) );
+		tb_puts( tb, RESETALL );
+	}
+}
 
+// withalpha is 0 for images without an alpha channel, which never need blending.
+static void print_image_double_res( textbuf_t* tb, int w, int h, unsigned char* data, int withalpha )
+{
+	const int doblend = blend && withalpha;
+	if ( h & 1 )
+		h--;
+	char cell[ CELLSZ ];
 	for ( int y=0; y<h; y+=2 )
 	{
 		const unsigned char* row0 = data + (y+0) * w * 4;
 		const unsigned char* row1 = data + (y+1) * w * 4;
-		line[0] = 0;
 		for ( int x=0; x<w; ++x )
+			tb_append( tb, cell, format_cell( cell, row0 + x * 4, row1 + x * 4, doblend ) );
+		tb_puts( tb, RESETALL );
+	}
+}
+
+
+static int cell_changed( const unsigned char* prev, const unsigned char* cur, size_t off0, size_t off1 )
+{
+	return memcmp( prev + off0, cur + off0, 4 ) || memcmp( prev + off1, cur + off1, 4 );
+}
+
+// Escape codes that turn an image already on the terminal, prev, into cur by
+// redrawing only the cells that differ. Runs of adjacent changed cells share
+// one cursor movement, so the output grows with the changed area rather than
+// the image size. The cursor starts and ends at the start of the line below
+// the image, where a full print leaves it.
+static void print_image_delta( textbuf_t* tb, int w, int h, const unsigned char* prev, const unsigned char* cur, int withalpha )
+{
+	const int doblend = blend && withalpha;
+	const int pixelsperrow = doubleres ? 2 : 1;
+	const int lines = h / pixelsperrow;
+	char cell[ CELLSZ ];
+	int cursorline = lines;
+	for ( int line=0; line<lines; ++line )
+	{
+		const size_t off0 = (size_t) line * pixelsperrow * w * 4;
+		const size_t off1 = doubleres ? off0 + w * 4 : off0;
+		int x = 0;
+		while ( x < w )
 		{
-			// foreground colour.
-			strncat( line, "\x1b[38;2;", sizeof(line) - strlen(line) - 1 );
-			char tripl[80];
-			unsigned char r = *row0++;
-			unsigned char g = *row0++;
-			unsigned char b = *row0++;
-			unsigned char a = *row0++;
-			if ( blend )
-				BLEND
-			snprintf( tripl, sizeof(tripl), "%d;%d;%dm", r,g,b );
-			strncat( line, tripl, sizeof(line) - strlen(line) - 1 );
-			// background colour.
-			strncat( line, "\x1b[48;2;", sizeof(line) - strlen(line) - 1 );
-			r = *row1++;
-			g = *row1++;
-			b = *row1++;
-			a = *row1++;
-			if ( blend )
-				BLEND
-			snprintf( tripl, sizeof(tripl), "%d;%d;%dm" HALFBLOCK, r,g,b );
-			strncat( line, tripl, sizeof(line) - strlen(line) - 1 );
+			if ( !cell_changed( prev, cur, off0 + x * 4, off1 + x * 4 ) )
+			{
+				x++;
+				continue;
+			}
+			int n;
+			if ( cursorline > line )
+				n = snprintf( cell, CELLSZ, "\x1b[%dA\x1b[%dG", cursorline - line, x + 1 );
+			else if ( cursorline < line )
+				n = snprintf( cell, CELLSZ, "\x1b[%dB\x1b[%dG", line - cursorline, x + 1 );
+			else
+				n = snprintf( cell, CELLSZ, "\x1b[%dG", x + 1 );
+			tb_append( tb, cell, n );
+			cursorline = line;
+			do
+			{
+				tb_append( tb, cell, format_cell( cell, cur + off0 + x * 4, cur + off1 + x * 4, doblend ) );
+				x++;
+			} while ( x < w && cell_changed( prev, cur, off0 + x * 4, off1 + x * 4 ) );
 		}
-		strncat( line, RESETALL, sizeof(line) - strlen(line) - 1 );
-		puts( line );
+	}
+	if ( cursorline < lines )
+	{
+		const int n = snprintf( cell, CELLSZ, RESETALL "\x1b[%dB\r", lines - cursorline );
+		tb_append( tb, cell, n );
 	}
 }
 
 
-static int process_image( const char* nm )
+// The whole encoded file, in memory, so the decoders can work on one contiguous
+// buffer instead of refilling a small stdio buffer byte by byte.
+typedef struct
 {
-	int imw=0,imh=0,n=0;
-	unsigned char *data = stbi_load( nm, &imw, &imh, &n, 4 );
-	if ( !data )
-		return -1;
-	//fprintf( stderr, "%s has dimension %dx%d w %d components.\n", nm, imw, imh, n );
+	unsigned char* data;
+	size_t size;
+	int mapped;	// data came from mmap, not malloc
+} filebuf_t;
 
-	float aspectratio = imw / (float) imh;
-	float pixels_per_char = imw / (float)termw;
+// Regular files are mapped; pipes and anything else that can't be mapped are
+// read into a malloc'd buffer. Only mapped files may be bigger than stb_image's
+// int lengths, for the formats that are sampled in place, see find_raw_pixels.
+static int load_file( const char* nm, filebuf_t* fb )
+{
+	fb->data = 0;
+	fb->size = 0;
+	fb->mapped = 0;
+#if !defined(_WIN64)
+	const int fd = open( nm, O_RDONLY );
+	if ( fd < 0 )
+		return 0;
+	struct stat st;
+	if ( fstat( fd, &st ) == 0 && S_ISREG( st.st_mode ) && st.st_size > 0 && (unsigned long long) st.st_size <= (size_t) -1 )
+	{
+		void* p = mmap( 0, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		if ( p != MAP_FAILED )
+		{
+			posix_madvise( p, (size_t) st.st_size, POSIX_MADV_SEQUENTIAL );
+			close( fd );
+			fb->data = (unsigned char*) p;
+			fb->size = (size_t) st.st_size;
+			fb->mapped = 1;
+			return 1;
+		}
+	}
+	close( fd );
+#endif
+	FILE* f = fopen( nm, "rb" );
+	if ( !f )
+		return 0;
+	size_t cap = 1<<16;
+	fb->data = (unsigned char*) malloc( cap );
+	while ( fb->data )
+	{
+		fb->size += fread( fb->data + fb->size, 1, cap - fb->size, f );
+		if ( fb->size < cap || cap > INT_MAX )
+			break;
+		unsigned char* grown = (unsigned char*) realloc( fb->data, cap * 2 );
+		if ( !grown )
+		{
+			free( fb->data );
+			fb->data = 0;
+			break;
+		}
+		fb->data = grown;
+		cap *= 2;
+	}
+	const int ok = fb->data && !ferror( f ) && fb->size > 0 && fb->size <= INT_MAX;
+	fclose( f );
+	if ( !ok )
+	{
+		free( fb->data );
+		fb->data = 0;
+	}
+	return ok;
+}
+
+
+static void free_file( filebuf_t* fb )
+{
+#if !defined(_WIN64)
+	if ( fb->mapped )
+		munmap( fb->data, fb->size );
+	else
+#endif
+		free( fb->data );
+	fb->data = 0;
+}
+
+
+// Decoders that support it (JPEG, interlaced PNG) can produce a 1/2, 1/4 or
+// 1/8 size image much faster than the full one. Use the largest reduction
+// that still leaves at least one source pixel per terminal column.
+static int pick_reduction( int imw )
+{
+	int shift = 0;
+	while ( shift < 3 && ( imw >> ( shift+1 ) ) >= termw )
+		shift++;
+	return shift;
+}
+
+
+enum { KIND_OTHER, KIND_JPEG, KIND_PROGRESSIVE_JPEG, KIND_PNG, KIND_INTERLACED_PNG, KIND_QOI, KIND_GIF, KIND_HDR, KIND_RAW };
+
+// Pixels for the resampler: an image decoded by stb_image, or one that is
+// stored raw and read straight out of the file.
+typedef struct
+{
+	const unsigned char* data;	// first pixel of the top row
+	long long xstride;		// bytes from a pixel to the next
+	long long ystride;		// bytes from a row to the one below; negative for bottom-up files
+	int w, h, n;			// size and channels
+	int bytes;			// bytes per channel, 1 or 2
+	int bgr;			// blue first, as BMP and TGA store it
+	int bigendian;			// 16-bit samples in file order, as PNM stores them
+} image_t;
+
+// What we know from the image header, and what we decided from it, before
+// anything gets decoded.
+typedef struct
+{
+	int kind;		// KIND_*, from the magic bytes
+	const char* format;	// file format, for -v
+	const char* strategy;	// how the decoder will produce the image, for -v
+	int imw, imh, n;	// size and channel count from the header
+	int bytes;		// bytes per channel of the decoded image: 2 for 16-bit PNG and PNM
+	long long memory;	// estimated peak decoder memory, see plan_memory
+	int memlimited;		// shift was raised to stay under --max-memory
+	int shift;		// reduction passed to stbi_set_reduce_on_load
+	int decw, dech;		// size the decoder will hand us
+	int outw, outh;		// size of the resampled image, in terminal pixels
+	float pixels_per_char;	// decoded pixels per output pixel
+	int kernelradius;	// half width of the box filter, in decoded pixels
+	image_t raw;		// for KIND_RAW, where the pixels are in the file
+	const char* decoder;	// backend that decoded the image, for -v
+	long long decodeus;	// and how long it took, in microseconds
+} plan_t;
+
+
+// Output geometry for a decoded image of decw x dech, at most maxw wide.
+static void plan_output( plan_t* plan, int decw, int dech, int maxw )
+{
+	assert( maxw >= 1 );
+	plan->decw = decw;
+	plan->dech = dech;
+	const float aspectratio = decw / (float) dech;
+	float pixels_per_char = decw / (float)maxw;
 	if ( pixels_per_char < 1 ) pixels_per_char = 1;
 	int kernelsize = (int) floorf( pixels_per_char );
 	if ( (kernelsize&1) == 0 ) kernelsize--;
 	if ( !kernelsize ) kernelsize=1;
-	const int kernelradius = (kernelsize-1)/2;
+	plan->pixels_per_char = pixels_per_char;
+	plan->kernelradius = (kernelsize-1)/2;
+	plan->outw = decw < maxw ? decw : maxw;
+	plan->outh = (int) roundf( plan->outw / aspectratio );
+}
+
 
-	const int outw = imw < termw ? imw : termw;
-	const int outh = (int) roundf( outw / aspectratio );
+// Rough peak heap use of stb_image for a plan, in bytes. JPEG keeps a plane
+// per component next to the output, and progressive JPEG also keeps every DCT
+// coefficient of the full-size image, whatever the reduction. PNG keeps the
+// compressed data (about the file size) and its output, 16-bit for 16-bit
+// images, and an 8-bit image also has its 8-bit rows on the way; interlaced
+// images go through another copy or two. QOI only holds its output. Anything
+// else is assumed to need a couple of full-size RGBA copies.
+static long long plan_memory( const plan_t* plan, size_t filesize )
+{
+	const long long full = (long long) plan->imw * plan->imh;
+	const long long dec = (long long) plan->decw * plan->dech;
+	switch ( plan->kind )
+	{
+		case KIND_JPEG:			return 2 * dec * plan->n;
+		case KIND_PROGRESSIVE_JPEG:	return 2 * dec * plan->n + 2 * full * plan->n;
+		case KIND_PNG:			return filesize + 2 * dec * plan->n;
+		case KIND_INTERLACED_PNG:	return filesize + 3 * dec * plan->n * plan->bytes;
+		case KIND_QOI:			return dec * plan->n;
+		case KIND_HDR:			return full * 3 * sizeof(float);
+		case KIND_RAW:			return 0;
+		default:			return 2 * full * 4;
+	}
+}
 
-	//fprintf( stderr, "pixels per char: %f, kernelsize: %d, out: %dx%d\n", pixels_per_char, kernelsize, outw, outh );
 
-	unsigned char out[ outh ][ outw ][ 4 ];
+static void plan_reduction( plan_t* plan, int shift )
+{
+	const int r = ( 1 << shift ) - 1;
+	plan->shift = shift;
+	plan_output( plan, ( plan->imw + r ) >> shift, ( plan->imh + r ) >> shift, termw );
+}
+
+
+// Raw images with more pixels than this are point-sampled down before the
+// box filter, see make_plan.
+#define RAW_SAMPLE_BUDGET	( 64LL << 20 )
+
+static unsigned le16( const unsigned char* p ) { return p[0] | p[1] << 8; }
+static unsigned le32( const unsigned char* p ) { return le16( p ) | (unsigned) le16( p + 2 ) << 16; }
+
+// Binary PNM, uncompressed 24-bit BMP and uncompressed true colour or grey
+// TGA keep their pixels at a fixed offset and stride, so there is nothing to
+// decode: the resampler can box filter them in place, without a decoded copy
+// of the image in memory. Fills in img and returns the format name
+// for the layouts stb_image would load as plain samples; anything else,
+// including files too short for their header, gets 0 and goes through
+// stb_image as before.
+static const char* find_raw_pixels( const unsigned char* d, size_t sz, image_t* img )
+{
+	const char* format;
+	long long w=0, h=0, offset=0, rowbytes;
+	int n=0, bytes=1, bottomup=0, bgr=0, padded=0;
+	if ( sz >= 3 && d[0] == 'P' && ( d[1] == '5' || d[1] == '6' ) )
+	{
+		// Parsed as stbi__pnm_info does: the samples start after the single
+		// whitespace character that ends the maximum value.
+		long long v[3] = { 0, 0, 0 };
+		size_t i = 2;
+		int c = d[ i++ ];
+		for ( int k=0; k<3; ++k )
+		{
+			for ( ;; )
+			{
+				while ( i < sz && ( c == ' ' || ( c >= '\t' && c <= '\r' ) ) )
+					c = d[ i++ ];
+				if ( i >= sz || c != '#' )
+					break;
+				while ( i < sz && c != '\n' && c != '\r' )
+					c = d[ i++ ];
+			}
+			while ( i < sz && c >= '0' && c <= '9' && v[ k ] < INT_MAX )
+			{
+				v[ k ] = v[ k ] * 10 + ( c - '0' );
+				c = d[ i++ ];
+			}
+		}
+		if ( v[ 2 ] > 65535 )
+			return 0;
+		w = v[ 0 ];
+		h = v[ 1 ];
+		n = d[1] == '6' ? 3 : 1;
+		bytes = v[ 2 ] > 255 ? 2 : 1;
+		offset = i;
+		format = n == 3 ? "binary PPM" : "binary PGM";
+	}
+	else if ( sz >= 54 && d[0] == 'B' && d[1] == 'M' )
+	{
+		const unsigned hsz = le32( d + 14 );
+		if ( hsz != 40 && hsz != 56 && hsz != 108 && hsz != 124 )
+			return 0;
+		if ( sz < 14 + hsz || le16( d + 26 ) != 1 || le16( d + 28 ) != 24 || le32( d + 30 ) != 0 )
+			return 0;
+		// The bigger headers carry an alpha mask, which makes stb_image add
+		// an (opaque) alpha channel.
+		if ( hsz >= 108 && le32( d + 66 ) )
+			return 0;
+		w = (int) le32( d + 18 );
+		h = (int) le32( d + 22 );
+		bottomup = h > 0;
+		h = h < 0 ? -h : h;
+		n = 3;
+		bgr = 1;
+		padded = 1;	// rows are padded to a multiple of 4 bytes
+		offset = le32( d + 10 );
+		if ( offset < 14 + hsz )
+			return 0;
+		format = "BMP";
+	}
+	else if ( sz >= 18 && d[1] == 0 && ( d[2] == 2 || d[2] == 3 ) )
+	{
+		// TGA has no magic; a zero second byte rules out all the formats that
+		// do, so stb_image would try TGA last and take this file as one.
+		const int bpp = d[16];
+		if ( d[2] == 2 && ( bpp == 24 || bpp == 32 ) )
+			n = bpp / 8;
+		else if ( d[2] == 3 && ( bpp == 8 || bpp == 16 ) )
+			n = bpp / 8;
+		else
+			return 0;
+		w = le16( d + 12 );
+		h = le16( d + 14 );
+		bottomup = !( d[17] & 0x20 );
+		bgr = n >= 3;
+		offset = 18 + d[0];
+		format = "TGA";
+	}
+	else
+		return 0;
+
+	if ( w <= 0 || h <= 0 || w > INT_MAX || h > INT_MAX )
+		return 0;
+	rowbytes = w * n * bytes;
+	const long long stride = padded ? ( rowbytes + 3 ) & ~3LL : rowbytes;
+	if ( offset + stride * ( h - 1 ) + rowbytes > (long long) sz )
+		return 0;
+	img->w = (int) w;
+	img->h = (int) h;
+	img->n = n;
+	img->bytes = bytes;
+	img->bgr = bgr;
+	img->bigendian = bytes == 2;
+	img->xstride = n * bytes;
+	img->ystride = bottomup ? -stride : stride;
+	img->data = d + offset + ( bottomup ? stride * ( h - 1 ) : 0 );
+	return format;
+}
+
+
+// Probe the header and decide how to decode and render the image. Returns 0
+// if the header can't be read, -1 if even the most reduced decode would need
+// more than --max-memory.
+static int make_plan( const filebuf_t* fb, plan_t* plan )
+{
+	const unsigned char* d = fb->data;
+	const size_t sz = fb->size;
+	const int len = sz > INT_MAX ? INT_MAX : (int) sz;	// enough for any header
+	if ( !stbi_info_from_memory( d, len, &plan->imw, &plan->imh, &plan->n ) )
+		return 0;
+
+	// Only JPEG and interlaced PNG can decode at a reduced size for less work.
+	// Plain PNG can be sampled down as it streams, which only saves memory.
+	int reducible = 0;
+	const char* rawformat;
+	plan->kind = KIND_OTHER;
+	plan->bytes = stbi_is_16_bit_from_memory( d, len ) ? 2 : 1;
+	plan->memlimited = 0;
+	plan->decoder = 0;
+	plan->format = "image";
+	plan->strategy = "format has no reduced decode";
+	if ( sz >= 2 && d[0] == 0xff && d[1] == 0xd8 )
+	{
+		// Find the start-of-frame marker to tell baseline from progressive.
+		int progressive = 0;
+		size_t i = 2;
+		while ( i+4 <= sz && d[i] == 0xff )
+		{
+			const int m = d[i+1];
+			if ( m == 0xff ) { i++; continue; }
+			if ( m >= 0xc0 && m <= 0xcf && m != 0xc4 && m != 0xc8 && m != 0xcc )
+			{
+				progressive = ( m & 3 ) == 2;
+				break;
+			}
+			i += 2 + ( d[i+2] << 8 | d[i+3] );
+		}
+		plan->kind = progressive ? KIND_PROGRESSIVE_JPEG : KIND_JPEG;
+		plan->format = progressive ? "progressive JPEG" : "JPEG";
+		reducible = 1;
+		plan->strategy = progressive ? "scaled IDCT, skipping scans the reduced IDCT does not read" : "scaled IDCT";
+	}
+	else if ( sz >= 29 && !memcmp( d, "\x89PNG", 4 ) )
+	{
+		const int interlaced = d[28] == 1;
+		plan->kind = interlaced ? KIND_INTERLACED_PNG : KIND_PNG;
+		plan->format = interlaced ? "interlaced PNG" : "PNG";
+		reducible = interlaced;
+		plan->strategy = interlaced ? "first Adam7 passes only" : "rows unfiltered while inflating";
+	}
+	else if ( sz >= 14 && !memcmp( d, "qoif", 4 ) )
+	{
+		plan->kind = KIND_QOI;
+		plan->format = "QOI";
+		plan->strategy = "pixels written out as they decode";
+	}
+	else if ( sz >= 3 && !memcmp( d, "GIF", 3 ) )
+	{
+		plan->kind = KIND_GIF;
+		plan->format = "GIF";
+		if ( play )
+			plan->strategy = "frames decoded one ahead of the display";
+	}
+	else if ( stbi_is_hdr_from_memory( d, len ) )
+	{
+		plan->kind = KIND_HDR;
+		plan->format = "Radiance HDR";
+		plan->strategy = "resampled as float, tone-mapped after";
+	}
+	else if ( ( rawformat = find_raw_pixels( d, sz, &plan->raw ) ) && plan->raw.w == plan->imw && plan->raw.h == plan->imh && plan->raw.n == plan->n )
+	{
+		plan->kind = KIND_RAW;
+		plan->format = rawformat;
+		plan->bytes = plan->raw.bytes;
+		plan->strategy = "sampled straight from the file";
+	}
+	if ( sz > INT_MAX && plan->kind != KIND_RAW )
+		return 0;	// stb_image can't take it
+
+	if ( plan->kind == KIND_RAW )
+	{
+		// The box filter reads every pixel in place. Only when that would
+		// be more than RAW_SAMPLE_BUDGET pixels, thin the image out to every
+		// (1<<shift)th pixel of every (1<<shift)th row, no further than
+		// about one per terminal column. That bounds the work for huge
+		// files, at the cost of aliasing fine detail.
+		int shift = 0;
+		while ( ( (long long) plan->imw >> shift ) * ( plan->imh >> shift ) > RAW_SAMPLE_BUDGET && ( plan->imw >> ( shift+1 ) ) >= termw )
+			shift++;
+		plan_reduction( plan, shift );
+		if ( shift )
+			plan->strategy = "point-sampled straight from the file, which may alias fine detail";
+		plan->raw.w = plan->decw;
+		plan->raw.h = plan->dech;
+		plan->raw.xstride *= 1 << plan->shift;
+		plan->raw.ystride *= 1 << plan->shift;
+	}
+	else
+		plan_reduction( plan, reducible ? pick_reduction( plan->imw ) : 0 );
+	if ( reducible && !plan->shift )
+		plan->strategy = "image is not wider than the terminal";
+
+	// Over the memory limit, reduce further where the decoder can.
+	plan->memory = plan_memory( plan, sz );
+	while ( maxmemory && plan->memory > maxmemory && plan->kind >= KIND_JPEG && plan->kind <= KIND_QOI && plan->shift < 3 )
+	{
+		plan_reduction( plan, plan->shift + 1 );
+		plan->memory = plan_memory( plan, sz );
+		plan->memlimited = 1;
+		if ( plan->kind == KIND_PNG )
+			plan->strategy = "rows sampled down while inflating";
+		if ( plan->kind == KIND_QOI )
+			plan->strategy = "pixels sampled down as they decode";
+	}
+	if ( maxmemory && plan->memory > maxmemory )
+		return -1;
+	return 1;
+}
+
+
+static void report_plan( const char* nm, const plan_t* plan )
+{
+	fprintf( stderr, "%s: %dx%d %s, %d channel%s.\n", nm, plan->imw, plan->imh, plan->format, plan->n, plan->n == 1 ? "" : "s" );
+	if ( plan->shift )
+		fprintf( stderr, "  decode: 1/%d scale (%dx%d), %s.\n", 1 << plan->shift, plan->decw, plan->dech, plan->strategy );
+	else
+		fprintf( stderr, "  decode: full size, %s.\n", plan->strategy );
+	fprintf( stderr, "  memory: about %lld MB%s.\n", plan->memory >> 20, plan->memlimited ? ", reduced to stay under --max-memory" : "" );
+	if ( plan->decoder )
+		fprintf( stderr, "  decoder: %s, %.2f ms.\n", plan->decoder, plan->decodeus / 1000.0 );
+	fprintf( stderr, "  output: %dx%d, %.2f pixels per character, %dx%d box filter.\n",
+		plan->outw, plan->outh, plan->pixels_per_char, 2*plan->kernelradius+1, 2*plan->kernelradius+1 );
+}
+
+
+// Box filter one output pixel from an image with NC channels (grey, grey+alpha,
+// rgb or rgba) of type T, with MAX for opaque, into premultiplied rgba. NC is
+// a constant at every use, so each channel count gets its own loop, and opaque
+// images skip the alpha math. GET reads a sample: SAMPLE, or SAMPLE_BE for
+// 16-bit samples still in big-endian file order.
+#define SAMPLE( r, i )		( r )[ i ]
+#define SAMPLE_BE( r, i )	( (unsigned) ( (const unsigned char*) ( (r) + (i) ) )[ 0 ] << 8 | ( (const unsigned char*) ( (r) + (i) ) )[ 1 ] )
+#define RESAMPLE_PIXEL( NC, T, MAX, GET ) \
+{ \
+	for ( int yy = sy; yy <= ey; ++yy ) \
+		for ( int xx = sx; xx <= ex; ++xx ) \
+		{ \
+			const T* reader = (const T*) ( img->data + yy * img->ystride + xx * img->xstride ); \
+			if ( NC == 4 ) \
+			{ \
+				const unsigned a = GET( reader, 3 ); \
+				acc[ 0 ] += a * GET( reader, 0 ) / MAX; \
+				acc[ 1 ] += a * GET( reader, 1 ) / MAX; \
+				acc[ 2 ] += a * GET( reader, 2 ) / MAX; \
+				acc[ 3 ] += a; \
+			} \
+			else if ( NC == 3 ) \
+			{ \
+				acc[ 0 ] += GET( reader, 0 ); \
+				acc[ 1 ] += GET( reader, 1 ); \
+				acc[ 2 ] += GET( reader, 2 ); \
+			} \
+			else if ( NC == 2 ) \
+			{ \
+				const unsigned a = GET( reader, 1 ); \
+				acc[ 0 ] += a * GET( reader, 0 ) / MAX; \
+				acc[ 3 ] += a; \
+			} \
+			else \
+				acc[ 0 ] += GET( reader, 0 ); \
+			numsamples++; \
+		} \
+	if ( NC < 3 ) \
+		acc[ 1 ] = acc[ 2 ] = acc[ 0 ]; \
+	if ( NC == 1 || NC == 3 ) \
+		acc[ 3 ] = MAX * numsamples; \
+}
+
+
+// An image as stb_image returns it: top-down, tightly packed, in host order.
+static image_t decoded_image( const void* data, int w, int h, int n, int bytes )
+{
+	const image_t img = { (const unsigned char*) data, n * bytes, (long long) w * n * bytes, w, h, n, bytes, 0, 0 };
+	return img;
+}
+
+
+// Box filter an image with 1 to 4 channels of 1 or 2 bytes down to the plan's
+// output size, as premultiplied rgba.
+static void resample_image( const plan_t* plan, const image_t* img, unsigned char* out )
+{
+	const float pixels_per_char = plan->pixels_per_char;
+	const int kernelradius = plan->kernelradius;
+	const int outw = plan->outw;
+	const int outh = plan->outh;
+	const int imw = img->w;
+	const int imh = img->h;
+	const int red = img->bgr ? 2 : 0;	// where red ends up in acc
+	const int blue = 2 - red;
+
 	for ( int y=0; y<outh; ++y )
 		for ( int x=0; x<outw; ++x )
 		{
 			const int cx = (int) roundf( pixels_per_char * x );
 			const int cy = (int) roundf( pixels_per_char * y );
-			int acc[4] = {0,0,0,0};
 			int numsamples=0;
 			int sy = cy-kernelradius;
 			sy = sy < 0 ? 0 : sy;
@@ -189,39 +988,786 @@ static int process_image( const char* nm )
 			sx = sx < 0 ? 0 : sx;
 			int ex = cx+kernelradius;
 			ex = ex >= imw ? imw-1 : ex;
+			unsigned char* writer = out + ( y * outw + x ) * 4;
+			if ( img->bytes == 2 )
+			{
+				// Sum the 16-bit samples as they are, and round to 8 bits once.
+				long long acc[4] = {0,0,0,0};
+				if ( img->bigendian )
+					switch ( img->n )
+					{
+						case 1:  RESAMPLE_PIXEL( 1, stbi_us, 65535, SAMPLE_BE ); break;
+						case 2:  RESAMPLE_PIXEL( 2, stbi_us, 65535, SAMPLE_BE ); break;
+						case 3:  RESAMPLE_PIXEL( 3, stbi_us, 65535, SAMPLE_BE ); break;
+						default: RESAMPLE_PIXEL( 4, stbi_us, 65535, SAMPLE_BE ); break;
+					}
+				else
+					switch ( img->n )
+					{
+						case 1:  RESAMPLE_PIXEL( 1, stbi_us, 65535, SAMPLE ); break;
+						case 2:  RESAMPLE_PIXEL( 2, stbi_us, 65535, SAMPLE ); break;
+						case 3:  RESAMPLE_PIXEL( 3, stbi_us, 65535, SAMPLE ); break;
+						default: RESAMPLE_PIXEL( 4, stbi_us, 65535, SAMPLE ); break;
+					}
+				const long long div = 257LL * numsamples;
+				writer[ 0 ] = ( acc[ red ] + div / 2 ) / div;
+				writer[ 1 ] = ( acc[ 1 ] + div / 2 ) / div;
+				writer[ 2 ] = ( acc[ blue ] + div / 2 ) / div;
+				writer[ 3 ] = ( acc[ 3 ] + div / 2 ) / div;
+				continue;
+			}
+			int acc[4] = {0,0,0,0};
+			switch ( img->n )
+			{
+				case 1:  RESAMPLE_PIXEL( 1, stbi_uc, 255, SAMPLE ); break;
+				case 2:  RESAMPLE_PIXEL( 2, stbi_uc, 255, SAMPLE ); break;
+				case 3:  RESAMPLE_PIXEL( 3, stbi_uc, 255, SAMPLE ); break;
+				default: RESAMPLE_PIXEL( 4, stbi_uc, 255, SAMPLE ); break;
+			}
+			writer[ 0 ] = acc[ red ] / numsamples;
+			writer[ 1 ] = acc[ 1 ] / numsamples;
+			writer[ 2 ] = acc[ blue ] / numsamples;
+			writer[ 3 ] = acc[ 3 ] / numsamples;
+		}
+}
+
+
+static void render_image( textbuf_t* tb, int outw, int outh, unsigned char* out, int withalpha )
+{
+	if ( doubleres )
+		print_image_double_res( tb, outw, outh, out, withalpha );
+	else
+		print_image_single_res( tb, outw, outh, out );
+}
+
+
+static void on_interrupt( int sig )
+{
+	(void) sig;
+	interrupted = 1;
+}
+
+
+// Write a finished frame to the terminal in one go, bypassing stdio so that
+// a line buffered stdout doesn't split it up.
+static void write_frame( const char* data, size_t size )
+{
+	fflush( stdout );
+#if defined(_WIN64)
+	fwrite( data, 1, size, stdout );
+	fflush( stdout );
+#else
+	while ( size )
+	{
+		const ssize_t written = write( STDOUT_FILENO, data, size );
+		if ( written < 0 && errno == EINTR )
+			continue;
+		if ( written <= 0 )
+			break;
+		data += written;
+		size -= (size_t) written;
+	}
+#endif
+}
+
+
+// Finished escape streams of animation frames, so that a looping animation
+// only has to decode, resample and format each frame once. Beyond the budget,
+// the least recently shown frames are dropped and decoded again when needed.
+// A stream only redraws what changed since the frame before it, so the
+// resampled pixels are kept too, to diff the next frame against.
+#define FRAME_CACHE_BUDGET	( 64 << 20 )
+
+typedef struct
+{
+	unsigned char* pixels;	// the resampled frame, followed in the same block by
+	char* stream;		// the escape codes that draw it over the previous frame
+	size_t size;		// of stream
+	int delay;		// in ms, as given in the file
+	long long lastused;
+} cachedframe_t;
+
+typedef struct
+{
+	cachedframe_t* frames;	// indexed by frame number; pixels is 0 if not cached
+	int cap;
+	size_t pixelsize;	// of a resampled frame
+	size_t bytes;
+	long long clock;
+} framecache_t;
+
+
+static cachedframe_t* cache_get( framecache_t* fc, int index )
+{
+	if ( index >= fc->cap || !fc->frames[ index ].pixels )
+		return 0;
+	fc->frames[ index ].lastused = ++fc->clock;
+	return fc->frames + index;
+}
+
+
+static void cache_put( framecache_t* fc, int index, const unsigned char* pixels, const textbuf_t* tb, int delay )
+{
+	const size_t size = fc->pixelsize + tb->size;
+	if ( size > FRAME_CACHE_BUDGET )
+		return;
+	if ( index >= fc->cap )
+	{
+		const int cap = fc->cap ? fc->cap * 2 : 64;
+		cachedframe_t* grown = (cachedframe_t*) realloc( fc->frames, cap * sizeof(cachedframe_t) );
+		if ( !grown )
+			return;
+		memset( grown + fc->cap, 0, ( cap - fc->cap ) * sizeof(cachedframe_t) );
+		fc->frames = grown;
+		fc->cap = cap;
+	}
+	while ( fc->bytes + size > FRAME_CACHE_BUDGET )
+	{
+		cachedframe_t* lru = 0;
+		for ( int i=0; i<fc->cap; ++i )
+			if ( fc->frames[ i ].pixels && ( !lru || fc->frames[ i ].lastused < lru->lastused ) )
+				lru = fc->frames + i;
+		if ( !lru )
+			return;
+		free( lru->pixels );
+		lru->pixels = 0;
+		fc->bytes -= fc->pixelsize + lru->size;
+	}
+	cachedframe_t* cf = fc->frames + index;
+	cf->pixels = (unsigned char*) malloc( size );
+	if ( !cf->pixels )
+		return;
+	memcpy( cf->pixels, pixels, fc->pixelsize );
+	cf->stream = (char*) cf->pixels + fc->pixelsize;
+	memcpy( cf->stream, tb->data, tb->size );
+	cf->size = tb->size;
+	cf->delay = delay;
+	cf->lastused = ++fc->clock;
+	fc->bytes += size;
+}
+
+
+static void cache_free( framecache_t* fc )
+{
+	for ( int i=0; i<fc->cap; ++i )
+		free( fc->frames[ i ].pixels );
+	free( fc->frames );
+}
+
+
+// Bring the decoder to frame number index. *decoded counts the frames it has
+// produced since the last rewind, so going back means starting over. Returns 0
+// past the last frame.
+static int seek_frame( stbi_gif_anim* anim, int index, int* decoded, unsigned char** frame, int* delay )
+{
+	if ( *decoded > index + 1 )
+	{
+		stbi_gif_anim_rewind( anim );
+		*decoded = 0;
+	}
+	while ( *decoded <= index )
+	{
+		*frame = stbi_gif_anim_next( anim, delay );
+		if ( !*frame )
+			return 0;
+		++*decoded;
+	}
+	return 1;
+}
+
+
+// Show the frames of a GIF in place, each for its own delay. Deadlines are
+// kept on an absolute clock, so the time spent decoding and formatting does
+// not add up; and the next frame is prepared while the current one is on
+// screen, so only the write happens at the deadline. Each frame after the
+// first only redraws the cells that changed, and after the first loop,
+// frames come from the cache.
+static int play_animation( const char* nm, const filebuf_t* fb, plan_t* plan )
+{
+	int imw=0, imh=0, delay=0;
+	stbi_gif_anim* anim = stbi_gif_anim_open_memory( fb->data, (int) fb->size, &imw, &imh );
+	unsigned char* frame = anim ? stbi_gif_anim_next( anim, &delay ) : 0;
+	if ( !frame )
+	{
+		stbi_gif_anim_close( anim );
+		return -1;
+	}
+	int decoded = 1;
+
+	// Redrawing in place moves the cursor back up over the frame, which only
+	// works if the whole frame fits on the screen.
+	const int linesperrow = doubleres ? 2 : 1;
+	// A very tall image is kept at least a column wide, even if it still won't fit.
+	if ( termh > 1 && plan->outh / linesperrow >= termh )
+	{
+		const int maxw = (int) ( ( termh - 1 ) * linesperrow * imw / (float) imh );
+		plan_output( plan, imw, imh, maxw > 1 ? maxw : 1 );
+	}
+	if ( verbose )
+		report_plan( nm, plan );
+
+	const int outw = plan->outw;
+	const int outh = plan->outh;
+	const size_t pixelsize = (size_t) outw * outh * 4;
+	unsigned char* out = (unsigned char*) malloc( pixelsize );
+	unsigned char* prev = (unsigned char*) malloc( pixelsize );	// what the terminal shows
+	textbuf_t tb = { 0, 0, 0 };
+	framecache_t cache = { 0, 0, pixelsize, 0, 0 };
+
+	void (*oldhandler)( int ) = signal( SIGINT, on_interrupt );
+	fputs( "\x1b[?25l", stdout );	// Hide the cursor while frames are drawn.
+	long long deadline = now_ms();
+	int shown = 0, index = 0, looped = 0, numframes = -1;
+	while ( out && prev && !interrupted )
+	{
+		if ( index == numframes )
+		{
+			// Go round again, unless there is nothing to animate.
+			if ( numframes < 2 || ++looped == loops )
+				break;
+			index = 0;
+		}
+		const unsigned char* pixels;
+		const char* stream;
+		size_t size;
+		const cachedframe_t* cf = cache_get( &cache, index );
+		if ( cf )
+		{
+			pixels = cf->pixels;
+			stream = cf->stream;
+			size = cf->size;
+			delay = cf->delay;
+		}
+		else if ( seek_frame( anim, index, &decoded, &frame, &delay ) )
+		{
+			const image_t img = decoded_image( frame, imw, imh, 4, 1 );
+			resample_image( plan, &img, out );
+			tb.size = 0;
+			if ( shown )
+			{
+				print_image_delta( &tb, outw, outh, prev, out, 1 );
+				cache_put( &cache, index, out, &tb, delay );
+			}
+			else
+				render_image( &tb, outw, outh, out, 1 );
+			pixels = out;
+			stream = tb.data;
+			size = tb.size;
+		}
+		else
+		{
+			numframes = index;
+			continue;
+		}
+
+		sleep_until( deadline );
+		if ( interrupted )
+			break;
+		write_frame( stream, size );
+		memcpy( prev, pixels, pixelsize );
+		shown++;
+		index++;
+
+		// Browsers show frames with (next to) no delay for 100ms; so do we.
+		deadline += delay < 20 ? 100 : delay;
+		// If we fell behind, start the clock over rather than rushing to catch up.
+		const long long now = now_ms();
+		if ( deadline < now )
+			deadline = now;
+	}
+	fputs( RESETALL "\x1b[?25h", stdout );
+	fflush( stdout );
+	signal( SIGINT, oldhandler );
+
+	cache_free( &cache );
+	free( tb.data );
+	free( prev );
+	free( out );
+	stbi_gif_anim_close( anim );
+	return shown ? 0 : -1;
+}
+
+
+// Tone curve for HDR images: 8-bit output for linear input in [0,1], at
+// TONE_LUT_SIZE+1 points. Interpolating between them stays within a level of
+// powf everywhere but the deepest shadows.
+#define TONE_LUT_SIZE 4096
+
+static void make_tone_lut( float* lut )
+{
+	for ( int i=0; i<=TONE_LUT_SIZE; ++i )
+		lut[ i ] = 255.0f * powf( i / (float) TONE_LUT_SIZE, 1.0f / displaygamma );
+}
+
+
+static unsigned char tone_map( const float* lut, float v )
+{
+	if ( !( v > 0.0f ) )
+		return 0;
+	if ( v >= 1.0f )
+		return 255;
+	const float f = v * TONE_LUT_SIZE;
+	const int i = (int) f;
+	return (unsigned char) ( lut[ i ] + ( lut[ i+1 ] - lut[ i ] ) * ( f - i ) + 0.5f );
+}
+
+
+// Radiance images are box filtered in linear float, and only the output
+// pixels go through the tone curve, instead of stb_image converting every
+// source pixel with pow before we get to see it.
+static int show_hdr_image( const char* nm, const filebuf_t* fb, plan_t* plan )
+{
+	int imw=0, imh=0, n=0;
+	float* data = stbi_loadf_from_memory( fb->data, (int) fb->size, &imw, &imh, &n, 3 );
+	if ( !data )
+		return -1;
+	if ( imw != plan->decw || imh != plan->dech )
+		plan_output( plan, imw, imh, termw );
+	if ( verbose )
+		report_plan( nm, plan );
+
+	const float pixels_per_char = plan->pixels_per_char;
+	const int kernelradius = plan->kernelradius;
+	const int outw = plan->outw;
+	const int outh = plan->outh;
+	const float scale = exp2f( exposure );
+	float lut[ TONE_LUT_SIZE+1 ];
+	make_tone_lut( lut );
+
+	unsigned char out[ outh ][ outw ][ 4 ];
+	for ( int y=0; y<outh; ++y )
+		for ( int x=0; x<outw; ++x )
+		{
+			const int cx = (int) roundf( pixels_per_char * x );
+			const int cy = (int) roundf( pixels_per_char * y );
+			const int sy = cy-kernelradius < 0 ? 0 : cy-kernelradius;
+			const int ey = cy+kernelradius >= imh ? imh-1 : cy+kernelradius;
+			const int sx = cx-kernelradius < 0 ? 0 : cx-kernelradius;
+			const int ex = cx+kernelradius >= imw ? imw-1 : cx+kernelradius;
+			float acc[3] = { 0,0,0 };
 			for ( int yy = sy; yy <= ey; ++yy )
-				for ( int xx = sx; xx <= ex; ++xx )
+			{
+				const float* reader = data + ( yy * imw + sx ) * 3;
+				for ( int xx = sx; xx <= ex; ++xx, reader += 3 )
 				{
-					unsigned char* reader = data + ( yy * imw * 4 ) + xx * 4;
-					const int a = reader[3];
-					acc[ 0 ] += a * reader[0] / 255;
-					acc[ 1 ] += a * reader[1] / 255;
-					acc[ 2 ] += a * reader[2] / 255;
-					acc[ 3 ] += reader[3];
-					numsamples++;
+					acc[ 0 ] += reader[ 0 ];
+					acc[ 1 ] += reader[ 1 ];
+					acc[ 2 ] += reader[ 2 ];
 				}
-			out[ y ][ x ][ 0 ] = acc[ 0 ] / numsamples;
-			out[ y ][ x ][ 1 ] = acc[ 1 ] / numsamples;
-			out[ y ][ x ][ 2 ] = acc[ 2 ] / numsamples;
-			out[ y ][ x ][ 3 ] = acc[ 3 ] / numsamples;
+			}
+			const float norm = scale / ( ( ey-sy+1 ) * ( ex-sx+1 ) );
+			out[ y ][ x ][ 0 ] = tone_map( lut, acc[ 0 ] * norm );
+			out[ y ][ x ][ 1 ] = tone_map( lut, acc[ 1 ] * norm );
+			out[ y ][ x ][ 2 ] = tone_map( lut, acc[ 2 ] * norm );
+			out[ y ][ x ][ 3 ] = 255;
 		}
-
 	stbi_image_free( data );
-	data = 0;
 
-	if ( doubleres )
-		print_image_double_res( outw, outh, (unsigned char*) out );
+	textbuf_t tb = { 0, 0, 0 };
+	render_image( &tb, outw, outh, (unsigned char*) out, 0 );
+	fwrite( tb.data, 1, tb.size, stdout );
+	free( tb.data );
+	return 0;
+}
+
+
+// Decoder backends for still images. stb_image reads every format; imcat can
+// also be built with faster libraries for the formats they handle (see the
+// Makefile), and those get the first go at a file. A backend decodes at the
+// plan's reduction and returns the pixels top-down and packed, with
+// plan->bytes per channel in host order, allocated with STBI_MALLOC so that
+// stbi_image_free releases them. It returns 0 to hand the file to the next
+// backend, which in the end is stb_image.
+typedef struct
+{
+	const char* name;
+	int (*accepts)( const plan_t* plan );
+	void* (*decode)( const filebuf_t* fb, const plan_t* plan, int* w, int* h, int* n );
+} decoder_t;
+
+static const char* decoder = 0;	// --decoder: the only backend to try before stb_image
+
+
+#if defined(IMCAT_TURBOJPEG)
+#	include <setjmp.h>
+#	include <jpeglib.h>
+
+// libjpeg reports fatal errors through error_exit, which must not return.
+typedef struct
+{
+	struct jpeg_error_mgr mgr;
+	jmp_buf escape;
+} jpegerror_t;
+
+static void jpeg_escape( j_common_ptr cinfo )
+{
+	longjmp( ( (jpegerror_t*) cinfo->err )->escape, 1 );
+}
+
+static void jpeg_quiet( j_common_ptr cinfo )
+{
+	(void) cinfo;
+}
+
+static int turbojpeg_accepts( const plan_t* plan )
+{
+	return plan->kind == KIND_JPEG || plan->kind == KIND_PROGRESSIVE_JPEG;
+}
+
+// libjpeg-turbo scales in the IDCT, like stb_image, to the same 1/2, 1/4 or
+// 1/8 size, so the plan holds as it is.
+static void* turbojpeg_decode( const filebuf_t* fb, const plan_t* plan, int* w, int* h, int* n )
+{
+	struct jpeg_decompress_struct cinfo;
+	jpegerror_t err;
+	unsigned char* volatile data = 0;
+	cinfo.err = jpeg_std_error( &err.mgr );
+	err.mgr.error_exit = jpeg_escape;
+	err.mgr.output_message = jpeg_quiet;
+	if ( setjmp( err.escape ) )
+	{
+		jpeg_destroy_decompress( &cinfo );
+		stbi_image_free( data );
+		return 0;
+	}
+	jpeg_create_decompress( &cinfo );
+	jpeg_mem_src( &cinfo, (unsigned char*) fb->data, fb->size );
+	jpeg_read_header( &cinfo, TRUE );
+	// libjpeg won't turn CMYK into RGB; stb_image will.
+	if ( cinfo.jpeg_color_space != JCS_GRAYSCALE && cinfo.jpeg_color_space != JCS_YCbCr && cinfo.jpeg_color_space != JCS_RGB )
+		longjmp( err.escape, 1 );
+	cinfo.out_color_space = cinfo.jpeg_color_space == JCS_GRAYSCALE ? JCS_GRAYSCALE : JCS_RGB;
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = 1 << plan->shift;
+	jpeg_start_decompress( &cinfo );
+	const size_t stride = (size_t) cinfo.output_width * cinfo.output_components;
+	data = (unsigned char*) STBI_MALLOC( stride * cinfo.output_height );
+	if ( !data )
+		longjmp( err.escape, 1 );
+	while ( cinfo.output_scanline < cinfo.output_height )
+	{
+		JSAMPROW row = data + cinfo.output_scanline * stride;
+		jpeg_read_scanlines( &cinfo, &row, 1 );
+	}
+	jpeg_finish_decompress( &cinfo );
+	*w = cinfo.output_width;
+	*h = cinfo.output_height;
+	*n = cinfo.output_components;
+	jpeg_destroy_decompress( &cinfo );
+	return data;
+}
+#endif
+
+
+#if defined(IMCAT_SPNG)
+#	include <spng.h>
+
+// A reduced interlaced image is left to stb_image, which then only inflates
+// the first Adam7 passes.
+static int spng_accepts( const plan_t* plan )
+{
+	return plan->kind == KIND_PNG || ( plan->kind == KIND_INTERLACED_PNG && !plan->shift );
+}
+
+// The channel layout follows stb_image's, with alpha where the file has it
+// or a tRNS chunk makes it, except that libspng has no 16-bit grey or rgb
+// output, so those always come with alpha. A reduced plain PNG is decoded a
+// row at a time, keeping every (1<<shift)th pixel of every (1<<shift)th row
+// like stb_image does, so the full image never exists.
+static void* spng_decode( const filebuf_t* fb, const plan_t* plan, int* w, int* h, int* n )
+{
+	static const int formats[ 2 ][ 5 ] =
+	{
+		{ 0, SPNG_FMT_G8, SPNG_FMT_GA8, SPNG_FMT_RGB8, SPNG_FMT_RGBA8 },
+		{ 0, 0, SPNG_FMT_GA16, 0, SPNG_FMT_RGBA16 },
+	};
+	const int shift = plan->shift;
+	const int r = ( 1 << shift ) - 1;
+	unsigned char* data = 0;
+	unsigned char* row = 0;
+	struct spng_ihdr ihdr;
+	struct spng_trns trns;
+	size_t size = 0;
+	int rv = -1;
+	spng_ctx* ctx = spng_ctx_new( 0 );
+	if ( !ctx )
+		return 0;
+	// stb_image doesn't check CRCs either.
+	spng_set_crc_action( ctx, SPNG_CRC_USE, SPNG_CRC_USE );
+	if ( spng_set_png_buffer( ctx, fb->data, fb->size ) || spng_get_ihdr( ctx, &ihdr ) )
+		goto done;
+	const int deep = ihdr.bit_depth == 16;
+	const int grey = !( ihdr.color_type & SPNG_COLOR_TYPE_TRUECOLOR );
+	const int alpha = deep || ( ihdr.color_type & SPNG_COLOR_TYPE_GRAYSCALE_ALPHA ) || !spng_get_trns( ctx, &trns );
+	const int nc = ( grey ? 1 : 3 ) + alpha;
+	const int fmt = formats[ deep ][ nc ];
+	const size_t pixelbytes = (size_t) nc * ( deep ? 2 : 1 );
+	if ( deep != ( plan->bytes == 2 ) || spng_decoded_image_size( ctx, fmt, &size ) )
+		goto done;
+	const int outw = ( (int) ihdr.width + r ) >> shift;
+	const int outh = ( (int) ihdr.height + r ) >> shift;
+	const size_t rowbytes = size / ihdr.height;
+	data = (unsigned char*) STBI_MALLOC( (size_t) outw * outh * pixelbytes );
+	if ( !data )
+		goto done;
+	if ( !shift )
+	{
+		rv = spng_decode_image( ctx, data, size, fmt, SPNG_DECODE_TRNS );
+		goto done;
+	}
+	row = (unsigned char*) STBI_MALLOC( rowbytes );
+	if ( !row || spng_decode_image( ctx, 0, 0, fmt, SPNG_DECODE_TRNS | SPNG_DECODE_PROGRESSIVE ) )
+		goto done;
+	do
+	{
+		struct spng_row_info info;
+		if ( spng_get_row_info( ctx, &info ) )
+			break;
+		rv = spng_decode_row( ctx, row, rowbytes );
+		if ( ( !rv || rv == SPNG_EOI ) && !( info.row_num & r ) )
+		{
+			unsigned char* writer = data + (size_t) ( info.row_num >> shift ) * outw * pixelbytes;
+			for ( int x=0; x<outw; ++x, writer += pixelbytes )
+				memcpy( writer, row + ( (size_t) x << shift ) * pixelbytes, pixelbytes );
+		}
+	} while ( !rv );
+	if ( rv == SPNG_EOI )
+		rv = 0;
+done:
+	spng_ctx_free( ctx );
+	stbi_image_free( row );
+	if ( rv )
+	{
+		stbi_image_free( data );
+		return 0;
+	}
+	*w = outw;
+	*h = outh;
+	*n = nc;
+	return data;
+}
+#endif
+
+
+static int stb_accepts( const plan_t* plan )
+{
+	(void) plan;
+	return 1;
+}
+
+static void* stb_decode( const filebuf_t* fb, const plan_t* plan, int* w, int* h, int* n )
+{
+	stbi_set_reduce_on_load( plan->shift );
+
+	// Keep the decoder's own channel layout and depth; the resampler
+	// handles all four layouts, at 8 or 16 bits.
+	return plan->bytes == 2
+		? (void*) stbi_load_16_from_memory( fb->data, (int) fb->size, w, h, n, 0 )
+		: (void*) stbi_load_from_memory( fb->data, (int) fb->size, w, h, n, 0 );
+}
+
+static const decoder_t decoders[] =
+{
+#if defined(IMCAT_TURBOJPEG)
+	{ "libjpeg-turbo", turbojpeg_accepts, turbojpeg_decode },
+#endif
+#if defined(IMCAT_SPNG)
+	{ "libspng", spng_accepts, spng_decode },
+#endif
+	{ "stb_image", stb_accepts, stb_decode },	// always last: it takes anything
+};
+#define NUMDECODERS	( (int) ( sizeof( decoders ) / sizeof( decoders[ 0 ] ) ) )
+
+
+// Decodes with the first backend that accepts the file and manages it, and
+// records which one that was in the plan.
+static void* decode_image( const filebuf_t* fb, plan_t* plan, int* w, int* h, int* n )
+{
+	for ( int i=0; i<NUMDECODERS; ++i )
+	{
+		const decoder_t* dec = decoders + i;
+		if ( decoder && i < NUMDECODERS-1 && strcmp( decoder, dec->name ) )
+			continue;
+		if ( !dec->accepts( plan ) )
+			continue;
+		void* data = dec->decode( fb, plan, w, h, n );
+		if ( data || i == NUMDECODERS-1 )
+		{
+			plan->decoder = dec->name;
+			return data;
+		}
+	}
+	return 0;
+}
+
+
+static int process_image( const char* nm )
+{
+	int imw=0,imh=0,n=0;
+	filebuf_t fb;
+	if ( !load_file( nm, &fb ) )
+		return -1;
+	plan_t plan;
+	const int planned = make_plan( &fb, &plan );
+	if ( planned <= 0 )
+		free_file( &fb );
+	if ( planned < 0 )
+	{
+		fprintf( stderr, "Skipping %s: a %dx%d %s would need about %lld MB to decode, over the --max-memory limit of %lld MB.\n",
+			nm, plan.imw, plan.imh, plan.format, ( plan.memory + ( 1 << 20 ) - 1 ) >> 20, maxmemory >> 20 );
+		return 0;
+	}
+	if ( !planned )
+		return -1;
+
+	if ( play && plan.kind == KIND_GIF )
+	{
+		const int rv = play_animation( nm, &fb, &plan );
+		free_file( &fb );
+		return rv;
+	}
+
+	if ( plan.kind == KIND_HDR )
+	{
+		const int rv = show_hdr_image( nm, &fb, &plan );
+		free_file( &fb );
+		return rv;
+	}
+
+	void *data = 0;
+	image_t img = plan.raw;
+	if ( plan.kind == KIND_RAW )
+	{
+#if !defined(_WIN64)
+		// The box filter walks the rows in order. When they are thinned
+		// out, only the sampled rows are wanted, and read-ahead would
+		// fetch the rest.
+		if ( fb.mapped )
+			posix_madvise( fb.data, fb.size, plan.shift ? POSIX_MADV_RANDOM : POSIX_MADV_SEQUENTIAL );
+#endif
+	}
 	else
-		print_image_single_res( outw, outh, (unsigned char*) out );
+	{
+		const long long start = now_us();
+		data = decode_image( &fb, &plan, &imw, &imh, &n );
+		plan.decodeus = now_us() - start;
+		free_file( &fb );
+		if ( !data )
+			return -1;
+		img = decoded_image( data, imw, imh, n, plan.bytes );
+		if ( imw != plan.decw || imh != plan.dech )
+			plan_output( &plan, imw, imh, termw );
+	}
+	if ( verbose )
+		report_plan( nm, &plan );
+
+	const int outw = plan.outw;
+	const int outh = plan.outh;
+	unsigned char out[ outh ][ outw ][ 4 ];
+	resample_image( &plan, &img, (unsigned char*) out );
+	if ( data )
+		stbi_image_free( data );
+	else
+		free_file( &fb );
+	data = 0;
+
+	textbuf_t tb = { 0, 0, 0 };
+	render_image( &tb, outw, outh, (unsigned char*) out, img.n == 2 || img.n == 4 );
+	fwrite( tb.data, 1, tb.size, stdout );
+	free( tb.data );
 	return 0;
 }
 
 
+// Returns the value of option name, given as "name=value" or "name value",
+// or 0 if argv[*i] is not that option.
+static const char* option_value( int argc, char* argv[], int* i, const char* name )
+{
+	const size_t len = strlen( name );
+	const char* arg = argv[ *i ];
+	if ( strncmp( arg, name, len ) )
+		return 0;
+	if ( arg[ len ] == '=' )
+		return arg + len + 1;
+	if ( !arg[ len ] && *i + 1 < argc )
+		return argv[ ++*i ];
+	return 0;
+}
+
+
+// Parses a number for option name that must be at least min, or exits with a message.
+static float option_float( const char* name, const char* val, float min )
+{
+	char* end = 0;
+	const float v = strtof( val, &end );
+	if ( end == val || *end || !( v >= min ) )
+	{
+		fprintf( stderr, "%s takes a number of at least %g, not '%s'.\n", name, min, val );
+		exit( 1 );
+	}
+	return v;
+}
+
+
+// Parses a non-negative count for option name, or exits with a message.
+static long long option_count( const char* name, const char* val, const char* what )
+{
+	char* end = 0;
+	const long long v = strtoll( val, &end, 10 );
+	if ( end == val || *end || v < 0 )
+	{
+		fprintf( stderr, "%s takes %s, not '%s'.\n", name, what, val );
+		exit( 1 );
+	}
+	return v;
+}
+
+
+// Checks the name given to --decoder against the backends built in, or exits with a message.
+static const char* option_decoder( const char* val )
+{
+	for ( int i=0; i<NUMDECODERS; ++i )
+		if ( !strcmp( val, decoders[ i ].name ) )
+			return val;
+	fprintf( stderr, "--decoder takes one of" );
+	for ( int i=0; i<NUMDECODERS; ++i )
+		fprintf( stderr, " %s", decoders[ i ].name );
+	fprintf( stderr, ", not '%s'.\n", val );
+	exit( 1 );
+}
+
+
 int main( int argc, char* argv[] )
 {
-	if ( argc == 1 || !strcmp( argv[1], "--help" ) )
+	// Options are consumed here; image names are compacted to argv[1..numimages].
+	int numimages = 0;
+	int usage = 0;
+	for ( int i=1; i<argc; ++i )
 	{
-		fprintf( stderr, "Usage: %s image [image2 .. imageN]\n", argv[0] );
+		const char* arg = argv[ i ];
+		const char* val;
+		if ( !strcmp( arg, "--help" ) )
+			usage = 1;
+		else if ( !strcmp( arg, "-v" ) || !strcmp( arg, "--verbose" ) )
+			verbose = 1;
+		else if ( !strcmp( arg, "--play" ) )
+			play = 1;
+		else if ( ( val = option_value( argc, argv, &i, "--max-memory" ) ) )
+			maxmemory = option_count( "--max-memory", val, "a size in megabytes (0 for no limit)" ) << 20;
+		else if ( ( val = option_value( argc, argv, &i, "--loops" ) ) )
+			loops = (int) option_count( "--loops", val, "a number of times (0 to loop until interrupted)" );
+		else if ( ( val = option_value( argc, argv, &i, "--exposure" ) ) )
+			exposure = option_float( "--exposure", val, -100.0f );
+		else if ( ( val = option_value( argc, argv, &i, "--gamma" ) ) )
+			displaygamma = option_float( "--gamma", val, 0.1f );
+		else if ( ( val = option_value( argc, argv, &i, "--decoder" ) ) )
+			decoder = option_decoder( val );
+		else
+			argv[ 1 + numimages++ ] = argv[ i ];
+	}
+	if ( usage || !numimages )
+	{
+		fprintf( stderr, "Usage: %s [-v|--verbose] [--max-memory MB] [--play [--loops N]] [--exposure EV] [--gamma G] [--decoder NAME] image [image2 .. imageN]\n", argv[0] );
 		exit( 0 );
 	}
 
@@ -244,12 +1790,15 @@ int main( int argc, char* argv[] )
 	//fprintf( stderr, "Your terminal is size %dx%d\n", termw, termh );
 
 	// Step 2: Process all images on the command line.
-	for ( int i=1; i<argc; ++i )
+	for ( int i=1; i<=numimages; ++i )
 	{
+		if ( interrupted )
+			break;
 		const char* nm = argv[ i ];
 		int rv = process_image( nm );
 		if ( rv < 0 )
 			fprintf( stderr, "Could not load image %s\n", nm );
+		arena_reset();
 	}
 
 #if defined(_WIN64)
@@ -30,10 +30,10 @@
       GIF (*comp always reports as 4-channel)
       HDR (radiance rgbE format)
       PIC (Softimage PIC)
-      PNM (PPM and PGM binary only)
+      PNM (PPM and PGM binary only, 8/16 bit-per-channel)
+      QOI
 
-      Animated GIF still needs a proper API, but here's one way to do it:
-          http://gist.github.com/urraka/685d9a6340b26b830d49
+      Animated GIF, one frame at a time (stbi_gif_anim_open_memory)
 
       - decode from memory or through FILE (define STBI_NO_STDIO to remove code)
       - decode from arbitrary I/O callbacks
@@ -281,6 +281,7 @@ RECENT REVISION HISTORY:
 //        STBI_NO_HDR
 //        STBI_NO_PIC
 //        STBI_NO_PNM   (.ppm and .pgm)
+//        STBI_NO_QOI
 //
 //  - You can request *only* certain decoders and suppress all other ones
 //    (this will be more forward-compatible, as addition of new decoders
@@ -295,10 +296,18 @@ RECENT REVISION HISTORY:
 //        STBI_ONLY_HDR
 //        STBI_ONLY_PIC
 //        STBI_ONLY_PNM   (.ppm and .pgm)
+//        STBI_ONLY_QOI
 //
 //   - If you use STBI_NO_PNG (or _ONLY_ without PNG), and you still
 //     want the zlib decoder to be available, #define STBI_SUPPORT_ZLIB
 //
+//   - #define STBI_THREADS (and link with pthreads) to decode baseline JPEGs
+//     that have restart markers on several threads, when loading from
+//     memory. Each thread decodes a run of restart intervals. The number
+//     of threads is the number of online CPUs, at most STBI_MAX_THREADS
+//     (default 8). Large non-interlaced PNGs are inflated on a second
+//     thread while the calling thread unfilters the rows.
+//
 
 
 #ifndef STBI_NO_STDIO
@@ -406,8 +415,9 @@ STBIDEF int      stbi_is_hdr_from_file(FILE *f);
 #endif // STBI_NO_STDIO
 
 
-// get a VERY brief reason for failure
-// NOT THREADSAFE
+// get a VERY brief reason for failure. with thread-local storage (see
+// STBI_NO_THREAD_LOCALS below) this is the reason for the last failure on
+// the calling thread; otherwise it is shared, and NOT THREADSAFE
 STBIDEF const char *stbi_failure_reason  (void);
 
 // free the loaded image -- this is just free()
@@ -416,6 +426,9 @@ STBIDEF void     stbi_image_free      (void *retval_from_stbi_load);
 // get image dimensions & components without fully decoding
 STBIDEF int      stbi_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp);
 STBIDEF int      stbi_info_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp);
+// true if the image has 16 bits per channel (PNG and PNM), so that
+// stbi_load_16 returns it without loss
+STBIDEF int      stbi_is_16_bit_from_memory(stbi_uc const *buffer, int len);
 
 #ifndef STBI_NO_STDIO
 STBIDEF int      stbi_info            (char const *filename,     int *x, int *y, int *comp);
@@ -437,6 +450,38 @@ STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert);
 // flip the image vertically, so the first pixel in the output array is the bottom left
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 
+// as above, but only for images loaded on the calling thread, overriding the
+// setting made above. only available if the compiler has thread-local
+// variables; calling them fails to link otherwise
+STBIDEF void stbi_set_unpremultiply_on_load_thread(int flag_true_if_should_unpremultiply);
+STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_convert);
+STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_flip);
+
+// for formats that can produce a smaller image for less work than a full
+// decode (currently JPEG, via a reduced-size IDCT, and interlaced PNG, by
+// using only the first adam7 passes), return the image scaled
+// by 1/(1<<shift), rounded up. shift is clamped to 0..3; the x,y returned
+// by the load functions are the reduced dimensions. non-interlaced PNGs
+// and QOI images are point-sampled as they are decoded: that takes no less
+// time, but the full-size image is never held in memory. other formats
+// ignore this and return the full image.
+STBIDEF void stbi_set_reduce_on_load(int shift);
+STBIDEF void stbi_set_reduce_on_load_thread(int shift);
+
+#ifndef STBI_NO_GIF
+// animated GIF, decoded one frame at a time from a buffer that must outlive
+// the stbi_gif_anim. each frame is the full x*y canvas as 4-channel RGBA,
+// composited as a browser shows it, and belongs to the stbi_gif_anim: it is
+// valid until the next call. *delay_ms gets the frame's delay as stored in the
+// file (0 if none). stbi_gif_anim_next returns NULL after the last frame, or
+// on a corrupt frame, in which case stbi_failure_reason() says why.
+typedef struct stbi_gif_anim stbi_gif_anim;
+STBIDEF stbi_gif_anim *stbi_gif_anim_open_memory(stbi_uc const *buffer, int len, int *x, int *y);
+STBIDEF stbi_uc       *stbi_gif_anim_next       (stbi_gif_anim *anim, int *delay_ms);
+STBIDEF void           stbi_gif_anim_rewind     (stbi_gif_anim *anim);
+STBIDEF void           stbi_gif_anim_close      (stbi_gif_anim *anim);
+#endif
+
 // ZLIB client - used by PNG, available for other purposes
 
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen);
@@ -462,7 +507,7 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
 #if defined(STBI_ONLY_JPEG) || defined(STBI_ONLY_PNG) || defined(STBI_ONLY_BMP) \
   || defined(STBI_ONLY_TGA) || defined(STBI_ONLY_GIF) || defined(STBI_ONLY_PSD) \
   || defined(STBI_ONLY_HDR) || defined(STBI_ONLY_PIC) || defined(STBI_ONLY_PNM) \
-  || defined(STBI_ONLY_ZLIB)
+  || defined(STBI_ONLY_QOI) || defined(STBI_ONLY_ZLIB)
    #ifndef STBI_ONLY_JPEG
    #define STBI_NO_JPEG
    #endif
@@ -490,6 +535,9 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
    #ifndef STBI_ONLY_PNM
    #define STBI_NO_PNM
    #endif
+   #ifndef STBI_ONLY_QOI
+   #define STBI_NO_QOI
+   #endif
 #endif
 
 #if defined(STBI_NO_PNG) && !defined(STBI_SUPPORT_ZLIB) && !defined(STBI_NO_ZLIB)
@@ -507,10 +555,40 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
 #include <math.h>  // ldexp
 #endif
 
+#if defined(STBI_THREADS) && (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG))
+#define STBI__THREADS
+#include <pthread.h>
+#include <unistd.h>  // sysconf
+#ifndef STBI_MAX_THREADS
+#define STBI_MAX_THREADS 8
+#endif
+#endif
+
 #ifndef STBI_NO_STDIO
 #include <stdio.h>
 #endif
 
+// the failure reason and the *_thread settings are kept per thread, so
+// images can be loaded on several threads at once. #define
+// STBI_NO_THREAD_LOCALS on a platform without thread-local storage
+#ifndef STBI_NO_THREAD_LOCALS
+   #if defined(__cplusplus) && __cplusplus >= 201103L
+      #define STBI_THREAD_LOCAL       thread_local
+   #elif defined(__GNUC__) && __GNUC__ < 5
+      #define STBI_THREAD_LOCAL       __thread
+   #elif defined(_MSC_VER)
+      #define STBI_THREAD_LOCAL       __declspec(thread)
+   #elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+      #define STBI_THREAD_LOCAL       _Thread_local
+   #endif
+
+   #ifndef STBI_THREAD_LOCAL
+      #if defined(__GNUC__)
+         #define STBI_THREAD_LOCAL    __thread
+      #endif
+   #endif
+#endif
+
 #ifndef STBI_ASSERT
 #include <assert.h>
 #define STBI_ASSERT(x) assert(x)
@@ -533,12 +611,14 @@ typedef unsigned short stbi__uint16;
 typedef   signed short stbi__int16;
 typedef unsigned int   stbi__uint32;
 typedef   signed int   stbi__int32;
+typedef unsigned __int64 stbi__uint64;
 #else
 #include <stdint.h>
 typedef uint16_t stbi__uint16;
 typedef int16_t  stbi__int16;
 typedef uint32_t stbi__uint32;
 typedef int32_t  stbi__int32;
+typedef uint64_t stbi__uint64;
 #endif
 
 // should produce compiler error if size is wrong
@@ -640,7 +720,7 @@ static int stbi__cpuid3(void)
 
 #		define STBI_SIMD_ALIGN(type, name) __declspec(align(16)) type name
 
-#		ifndef STBI_NO_JPEG
+#		if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)
 static int stbi__sse2_available(void)
 {
    int info3 = stbi__cpuid3();
@@ -649,7 +729,7 @@ static int stbi__sse2_available(void)
 #		endif
 #	else // assume GCC-style if not VC++
 #		define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
-#		ifndef STBI_NO_JPEG
+#		if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)
 static int stbi__sse2_available(void)
 {
    // If we're even attempting to compile this on GCC/Clang, that means
@@ -661,6 +741,36 @@ static int stbi__sse2_available(void)
 #	endif
 #endif
 
+// AVX2 kernels are compiled for that target on their own and picked at run
+// time, so the rest of the library still only assumes SSE2. define
+// STBI_NO_AVX2 to leave them out.
+#if defined(STBI_SSE2) && !defined(STBI_NO_AVX2) && !defined(STBI_NO_JPEG)
+#	if defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#		define STBI_AVX2
+#		define STBI__AVX2_TARGET __attribute__((target("avx2")))
+#		include <immintrin.h>
+static int stbi__avx2_available(void)
+{
+   return __builtin_cpu_supports("avx2");
+}
+#	elif defined(_MSC_VER) && _MSC_VER >= 1700
+#		define STBI_AVX2
+#		define STBI__AVX2_TARGET
+#		include <immintrin.h>
+static int stbi__avx2_available(void)
+{
+   int info[4];
+   __cpuid(info, 0);
+   if (info[0] < 7) return 0;
+   __cpuid(info, 1);
+   if ((info[2] & (3 << 27)) != (3 << 27)) return 0; // OSXSAVE and AVX
+   if ((_xgetbv(0) & 6) != 6) return 0;              // OS saves ymm state
+   __cpuidex(info, 7, 0);
+   return (info[1] >> 5) & 1;
+}
+#	endif
+#endif
+
 // ARM NEON
 #if defined(STBI_NO_SIMD) && defined(STBI_NEON)
 #undef STBI_NEON
@@ -831,8 +941,18 @@ static void    *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int
 static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp);
 #endif
 
-// this is not threadsafe
-static const char *stbi__g_failure_reason;
+#ifndef STBI_NO_QOI
+static int      stbi__qoi_test(stbi__context *s);
+static void    *stbi__qoi_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri);
+static int      stbi__qoi_info(stbi__context *s, int *x, int *y, int *comp);
+#endif
+
+#ifdef STBI_THREAD_LOCAL
+static STBI_THREAD_LOCAL
+#else
+static
+#endif
+const char *stbi__g_failure_reason;
 
 STBIDEF const char *stbi_failure_reason(void)
 {
@@ -936,6 +1056,15 @@ static void *stbi__malloc_mad4(int a, int b, int c, int d, int add)
 #define stbi__errpf(x,y)   ((float *)(size_t) (stbi__err(x,y)?NULL:NULL))
 #define stbi__errpuc(x,y)  ((unsigned char *)(size_t) (stbi__err(x,y)?NULL:NULL))
 
+#ifdef STBI__THREADS
+// how many threads a decode may use, the calling one included
+static int stbi__thread_count(void)
+{
+   long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+   return cpus < 1 ? 1 : cpus < STBI_MAX_THREADS ? (int) cpus : STBI_MAX_THREADS;
+}
+#endif
+
 STBIDEF void stbi_image_free(void *retval_from_stbi_load)
 {
    STBI_FREE(retval_from_stbi_load);
@@ -949,44 +1078,135 @@ static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp);
 static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp);
 #endif
 
-static int stbi__vertically_flip_on_load = 0;
+static int stbi__vertically_flip_on_load_global = 0;
 
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip)
 {
-    stbi__vertically_flip_on_load = flag_true_if_should_flip;
+    stbi__vertically_flip_on_load_global = flag_true_if_should_flip;
 }
 
+static int stbi__reduce_on_load_global = 0;
+
+static int stbi__clamp_reduce(int shift)
+{
+    return shift < 0 ? 0 : shift > 3 ? 3 : shift;
+}
+
+STBIDEF void stbi_set_reduce_on_load(int shift)
+{
+    stbi__reduce_on_load_global = stbi__clamp_reduce(shift);
+}
+
+#ifndef STBI_THREAD_LOCAL
+#define stbi__vertically_flip_on_load  stbi__vertically_flip_on_load_global
+#define stbi__reduce_on_load           stbi__reduce_on_load_global
+#else
+// a setting made with the _thread function wins over the global one
+static STBI_THREAD_LOCAL int stbi__vertically_flip_on_load_local, stbi__vertically_flip_on_load_set;
+static STBI_THREAD_LOCAL int stbi__reduce_on_load_local, stbi__reduce_on_load_set;
+
+STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_flip)
+{
+    stbi__vertically_flip_on_load_local = flag_true_if_should_flip;
+    stbi__vertically_flip_on_load_set = 1;
+}
+
+STBIDEF void stbi_set_reduce_on_load_thread(int shift)
+{
+    stbi__reduce_on_load_local = stbi__clamp_reduce(shift);
+    stbi__reduce_on_load_set = 1;
+}
+
+#define stbi__vertically_flip_on_load  (stbi__vertically_flip_on_load_set       \
+                                         ? stbi__vertically_flip_on_load_local  \
+                                         : stbi__vertically_flip_on_load_global)
+#define stbi__reduce_on_load           (stbi__reduce_on_load_set                \
+                                         ? stbi__reduce_on_load_local           \
+                                         : stbi__reduce_on_load_global)
+#endif // STBI_THREAD_LOCAL
+
+#define STBI__SNIFF_JPEG   (1 << 0)
+#define STBI__SNIFF_PNG    (1 << 1)
+#define STBI__SNIFF_BMP    (1 << 2)
+#define STBI__SNIFF_GIF    (1 << 3)
+#define STBI__SNIFF_PSD    (1 << 4)
+#define STBI__SNIFF_PIC    (1 << 5)
+#define STBI__SNIFF_PNM    (1 << 6)
+#define STBI__SNIFF_HDR    (1 << 7)
+#define STBI__SNIFF_TGA    (1 << 8)
+#define STBI__SNIFF_QOI    (1 << 9)
+#define STBI__SNIFF_ANY    0x3ff
+
+static int stbi__sniff_is(stbi_uc const *p, int n, char const *magic, int len)
+{
+   return n >= len && memcmp(p, magic, len) == 0;
+}
+
+// Decide from the bytes already buffered which decoders could possibly
+// accept this stream, so we don't run every format's test in turn. Every
+// format but TGA starts with a signature, and none of those signatures is
+// a valid TGA header (the second byte would be an invalid colormap type),
+// so no match means TGA. If a callback stream returned a short first
+// read we can't tell, and fall back to testing everything.
+static int stbi__sniff(stbi__context *s)
+{
+   stbi_uc const *p = s->img_buffer;
+   int n = (int) (s->img_buffer_end - s->img_buffer);
+
+   if (n >= 3 && p[0] == 0xff && p[1] == 0xd8 && p[2] == 0xff)  return STBI__SNIFF_JPEG;
+   if (stbi__sniff_is(p, n, "\x89PNG\r\n\x1a\n", 8))           return STBI__SNIFF_PNG;
+   if (stbi__sniff_is(p, n, "BM", 2))                           return STBI__SNIFF_BMP;
+   if (stbi__sniff_is(p, n, "GIF8", 4))                         return STBI__SNIFF_GIF;
+   if (stbi__sniff_is(p, n, "8BPS", 4))                         return STBI__SNIFF_PSD;
+   if (stbi__sniff_is(p, n, "\x53\x80\xf6\x34", 4))             return STBI__SNIFF_PIC;
+   if (n >= 2 && p[0] == 'P' && (p[1] == '5' || p[1] == '6'))   return STBI__SNIFF_PNM;
+   if (stbi__sniff_is(p, n, "#?RADIANCE\n", 11) ||
+       stbi__sniff_is(p, n, "#?RGBE\n", 7))                     return STBI__SNIFF_HDR;
+   if (stbi__sniff_is(p, n, "qoif", 4))                         return STBI__SNIFF_QOI;
+   if (n < 16 && s->read_from_callbacks)                        return STBI__SNIFF_ANY;
+   return STBI__SNIFF_TGA;
+}
+
+// a format picked out by its signature goes straight to its loader, which
+// checks the header again anyway; otherwise run the format's own test
+#define stbi__sniffed(f, fmt, test)   ((f) == (fmt) || (((f) & (fmt)) && (test)))
+
 static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
 {
+   int f = stbi__sniff(s);
    memset(ri, 0, sizeof(*ri)); // make sure it's initialized if we add new fields
    ri->bits_per_channel = 8; // default is 8 so most paths don't have to be changed
    ri->channel_order = STBI_ORDER_RGB; // all current input & output are this, but this is here so we can add BGR order
    ri->num_channels = 0;
 
    #ifndef STBI_NO_JPEG
-   if (stbi__jpeg_test(s)) return stbi__jpeg_load(s,x,y,comp,req_comp, ri);
+   if (stbi__sniffed(f, STBI__SNIFF_JPEG, stbi__jpeg_test(s))) return stbi__jpeg_load(s,x,y,comp,req_comp, ri);
    #endif
    #ifndef STBI_NO_PNG
-   if (stbi__png_test(s))  return stbi__png_load(s,x,y,comp,req_comp, ri);
+   if (stbi__sniffed(f, STBI__SNIFF_PNG, stbi__png_test(s)))   return stbi__png_load(s,x,y,comp,req_comp, ri);
    #endif
    #ifndef STBI_NO_BMP
-   if (stbi__bmp_test(s))  return stbi__bmp_load(s,x,y,comp,req_comp, ri);
+   if (stbi__sniffed(f, STBI__SNIFF_BMP, stbi__bmp_test(s)))   return stbi__bmp_load(s,x,y,comp,req_comp, ri);
    #endif
    #ifndef STBI_NO_GIF
-   if (stbi__gif_test(s))  return stbi__gif_load(s,x,y,comp,req_comp, ri);
+   if (stbi__sniffed(f, STBI__SNIFF_GIF, stbi__gif_test(s)))   return stbi__gif_load(s,x,y,comp,req_comp, ri);
    #endif
    #ifndef STBI_NO_PSD
-   if (stbi__psd_test(s))  return stbi__psd_load(s,x,y,comp,req_comp, ri, bpc);
+   if (stbi__sniffed(f, STBI__SNIFF_PSD, stbi__psd_test(s)))   return stbi__psd_load(s,x,y,comp,req_comp, ri, bpc);
    #endif
    #ifndef STBI_NO_PIC
-   if (stbi__pic_test(s))  return stbi__pic_load(s,x,y,comp,req_comp, ri);
+   // the PIC loader doesn't look at the signature itself
+   if ((f & STBI__SNIFF_PIC) && stbi__pic_test(s))  return stbi__pic_load(s,x,y,comp,req_comp, ri);
    #endif
    #ifndef STBI_NO_PNM
-   if (stbi__pnm_test(s))  return stbi__pnm_load(s,x,y,comp,req_comp, ri);
+   if (stbi__sniffed(f, STBI__SNIFF_PNM, stbi__pnm_test(s)))   return stbi__pnm_load(s,x,y,comp,req_comp, ri);
+   #endif
+   #ifndef STBI_NO_QOI
+   if (stbi__sniffed(f, STBI__SNIFF_QOI, stbi__qoi_test(s)))   return stbi__qoi_load(s,x,y,comp,req_comp, ri);
    #endif
 
    #ifndef STBI_NO_HDR
-   if (stbi__hdr_test(s)) {
+   if (stbi__sniffed(f, STBI__SNIFF_HDR, stbi__hdr_test(s))) {
       float *hdr = stbi__hdr_load(s, x,y,comp,req_comp, ri);
       return stbi__hdr_to_ldr(hdr, *x, *y, req_comp ? req_comp : *comp);
    }
@@ -994,7 +1214,7 @@ static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int re
 
    #ifndef STBI_NO_TGA
    // test tga last because it's a crappy test!
-   if (stbi__tga_test(s))
+   if ((f & STBI__SNIFF_TGA) && stbi__tga_test(s))
       return stbi__tga_load(s,x,y,comp,req_comp, ri);
    #endif
 
@@ -1680,6 +1900,7 @@ typedef struct
       stbi_uc *linebuf;
       short   *coeff;   // progressive only
       int      coeff_w, coeff_h; // number of 8x8 coefficient blocks
+      int      skipped_from;     // progressive: lowest coefficient of a skipped scan
    } img_comp[4];
 
    stbi__uint32   code_buffer; // jpeg entropy-coded buffer
@@ -1699,9 +1920,11 @@ typedef struct
 
    int scan_n, order[4];
    int restart_interval, todo;
+   int scale_shift; // each 8x8 block decodes to (8>>scale_shift)^2 pixels
 
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
+   void (*idct_block2_kernel)(stbi_uc *out0, stbi_uc *out1, int out_stride, short data0[64], short data1[64]); // optional, NULL if none
    void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
    stbi_uc *(*resample_row_hv_2_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
 } stbi__jpeg;
@@ -1957,6 +2180,53 @@ static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman
    return 1;
 }
 
+// decode one block but keep only the dequantized DC term, for 1/8 scale
+// decodes. the AC codes still have to be read to stay in sync with the
+// bitstream, but their values are skipped rather than extended and stored
+static int stbi__jpeg_decode_block_dc_only(stbi__jpeg *j, int *out_dc, stbi__huffman *hdc, stbi__huffman *hac, stbi__int16 *fac, int b, stbi__uint16 *dequant)
+{
+   int diff,dc,k;
+   int t;
+
+   if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
+   t = stbi__jpeg_huff_decode(j, hdc);
+   if (t < 0) return stbi__err("bad huffman code","Corrupt JPEG");
+
+   diff = t ? stbi__extend_receive(j, t) : 0;
+   dc = j->img_comp[b].dc_pred + diff;
+   j->img_comp[b].dc_pred = dc;
+   *out_dc = (short) (dc * dequant[0]);
+
+   k = 1;
+   do {
+      int c,r,s;
+      if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
+      c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+      r = fac[c];
+      if (r) { // fast-AC path, s covers both the code and the value bits
+         k += ((r >> 4) & 15) + 1;
+         s = r & 15;
+         j->code_buffer <<= s;
+         j->code_bits -= s;
+      } else {
+         int rs = stbi__jpeg_huff_decode(j, hac);
+         if (rs < 0) return stbi__err("bad huffman code","Corrupt JPEG");
+         s = rs & 15;
+         r = rs >> 4;
+         if (s == 0) {
+            if (rs != 0xf0) break; // end block
+            k += 16;
+         } else {
+            k += r + 1;
+            if (j->code_bits < s) stbi__grow_buffer_unsafe(j);
+            j->code_buffer <<= s;
+            j->code_bits -= s;
+         }
+      }
+   } while (k < 64);
+   return 1;
+}
+
 static int stbi__jpeg_decode_block_prog_dc(stbi__jpeg *j, short data[64], stbi__huffman *hdc, int b)
 {
    int diff,dc;
@@ -2214,6 +2484,62 @@ static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64])
    }
 }
 
+// reduced-size IDCTs for decoding at 1/2, 1/4 and 1/8 scale. an N-point
+// output only needs the lowest NxN frequencies; evaluating their basis
+// functions at the centre of each (8/N)-pixel group gives the scaled block
+// directly, like jidctred. constants are C(u)/2 * cos((2x+1)*u*pi/(2N)).
+static const int stbi__idct4_k[4][4] = {
+   { stbi__f2f(0.35355339f), stbi__f2f( 0.46193977f), stbi__f2f( 0.35355339f), stbi__f2f( 0.19134172f) },
+   { stbi__f2f(0.35355339f), stbi__f2f( 0.19134172f), stbi__f2f(-0.35355339f), stbi__f2f(-0.46193977f) },
+   { stbi__f2f(0.35355339f), stbi__f2f(-0.19134172f), stbi__f2f(-0.35355339f), stbi__f2f( 0.46193977f) },
+   { stbi__f2f(0.35355339f), stbi__f2f(-0.46193977f), stbi__f2f( 0.35355339f), stbi__f2f(-0.19134172f) },
+};
+static const int stbi__idct2_k[2][2] = {
+   { stbi__f2f(0.35355339f), stbi__f2f( 0.35355339f) },
+   { stbi__f2f(0.35355339f), stbi__f2f(-0.35355339f) },
+};
+
+static void stbi__idct_reduced(stbi_uc *out, int out_stride, short data[64], int n, const int *k)
+{
+   int i,j,u,v[16];
+   // columns: n outputs from the lowest n vertical frequencies, keeping
+   // 2 extra bits of precision like the full IDCT
+   for (u=0; u < n; ++u) {
+      for (i=0; i < n; ++i) {
+         int acc = 0;
+         for (j=0; j < n; ++j)
+            acc += data[j*8+u] * k[i*n+j];
+         v[i*n+u] = (acc + 512) >> 10;
+      }
+   }
+   // rows: 1<<12 from the constants plus 1<<2 from the first pass
+   for (i=0; i < n; ++i, out += out_stride) {
+      for (u=0; u < n; ++u) {
+         int acc = 8192 + (128<<14);
+         for (j=0; j < n; ++j)
+            acc += v[i*n+j] * k[u*n+j];
+         out[u] = stbi__clamp(acc >> 14);
+      }
+   }
+}
+
+static void stbi__idct_block_4x4(stbi_uc *out, int out_stride, short data[64])
+{
+   stbi__idct_reduced(out, out_stride, data, 4, &stbi__idct4_k[0][0]);
+}
+
+static void stbi__idct_block_2x2(stbi_uc *out, int out_stride, short data[64])
+{
+   stbi__idct_reduced(out, out_stride, data, 2, &stbi__idct2_k[0][0]);
+}
+
+static void stbi__idct_block_1x1(stbi_uc *out, int out_stride, short data[64])
+{
+   STBI_NOTUSED(out_stride);
+   // the DC term alone is the block average, scaled by 8
+   out[0] = stbi__clamp(((data[0] + 4) >> 3) + 128);
+}
+
 #ifdef STBI_SSE2
 // sse2 integer IDCT. not the fastest possible implementation but it
 // produces bit-identical results to the generic C version so it's
@@ -2395,6 +2721,203 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 
 #endif // STBI_SSE2
 
+#ifdef STBI_AVX2
+// avx2 IDCT of two blocks at once, for horizontally adjacent blocks. each
+// 128-bit lane runs the sse2 code above, so results are still bit-identical
+// to the generic C version.
+static STBI__AVX2_TARGET void stbi__idct_avx2(stbi_uc *out0, stbi_uc *out1, int out_stride, short data0[64], short data1[64])
+{
+   // Same arithmetic as stbi__idct_simd; block 0 is in the low 128-bit lane
+   // of every register and block 1 in the high one.
+   __m256i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m256i tmp;
+
+   // dot product constant: even elems=x, odd elems=y
+   #define dct_const(x,y)  _mm256_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y))
+
+   // out(0) = c0[even]*x + c0[odd]*y   (c0, x, y 16-bit, out 32-bit)
+   // out(1) = c1[even]*x + c1[odd]*y
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m256i c0##lo = _mm256_unpacklo_epi16((x),(y)); \
+      __m256i c0##hi = _mm256_unpackhi_epi16((x),(y)); \
+      __m256i out0##_l = _mm256_madd_epi16(c0##lo, c0); \
+      __m256i out0##_h = _mm256_madd_epi16(c0##hi, c0); \
+      __m256i out1##_l = _mm256_madd_epi16(c0##lo, c1); \
+      __m256i out1##_h = _mm256_madd_epi16(c0##hi, c1)
+
+   // out = in << 12  (in 16-bit, out 32-bit)
+   #define dct_widen(out, in) \
+      __m256i out##_l = _mm256_srai_epi32(_mm256_unpacklo_epi16(_mm256_setzero_si256(), (in)), 4); \
+      __m256i out##_h = _mm256_srai_epi32(_mm256_unpackhi_epi16(_mm256_setzero_si256(), (in)), 4)
+
+   // wide add
+   #define dct_wadd(out, a, b) \
+      __m256i out##_l = _mm256_add_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_add_epi32(a##_h, b##_h)
+
+   // wide sub
+   #define dct_wsub(out, a, b) \
+      __m256i out##_l = _mm256_sub_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_sub_epi32(a##_h, b##_h)
+
+   // butterfly a/b, add bias, then shift by "s" and pack
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m256i abiased_l = _mm256_add_epi32(a##_l, bias); \
+         __m256i abiased_h = _mm256_add_epi32(a##_h, bias); \
+         dct_wadd(sum, abiased, b); \
+         dct_wsub(dif, abiased, b); \
+         out0 = _mm256_packs_epi32(_mm256_srai_epi32(sum_l, s), _mm256_srai_epi32(sum_h, s)); \
+         out1 = _mm256_packs_epi32(_mm256_srai_epi32(dif_l, s), _mm256_srai_epi32(dif_h, s)); \
+      }
+
+   // 8-bit interleave step (for transposes)
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi8(a, b); \
+      b = _mm256_unpackhi_epi8(tmp, b)
+
+   // 16-bit interleave step (for transposes)
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi16(a, b); \
+      b = _mm256_unpackhi_epi16(tmp, b)
+
+   // row k of both blocks
+   #define dct_load(k) \
+      _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_load_si128((const __m128i *) (data0 + (k)*8))), \
+                              _mm_load_si128((const __m128i *) (data1 + (k)*8)), 1)
+
+   // low 8 bytes of each lane are one output row of each block
+   #define dct_store(v) \
+      { \
+         __m256i sv = (v); \
+         _mm_storel_epi64((__m128i *) out0, _mm256_castsi256_si128(sv)); out0 += out_stride; \
+         _mm_storel_epi64((__m128i *) out1, _mm256_extracti128_si256(sv, 1)); out1 += out_stride; \
+      }
+
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m256i sum04 = _mm256_add_epi16(row0, row4); \
+         __m256i dif04 = _mm256_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m256i sum17 = _mm256_add_epi16(row1, row7); \
+         __m256i sum35 = _mm256_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   __m256i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m256i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+
+   // rounding biases in column/row passes, see stbi__idct_block for explanation.
+   __m256i bias_0 = _mm256_set1_epi32(512);
+   __m256i bias_1 = _mm256_set1_epi32(65536 + (128<<17));
+
+   // load
+   row0 = dct_load(0);
+   row1 = dct_load(1);
+   row2 = dct_load(2);
+   row3 = dct_load(3);
+   row4 = dct_load(4);
+   row5 = dct_load(5);
+   row6 = dct_load(6);
+   row7 = dct_load(7);
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transpose pass 1
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      // transpose pass 2
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      // transpose pass 3
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      // pack
+      __m256i p0 = _mm256_packus_epi16(row0, row1); // a0a1a2a3...a7b0b1b2b3...b7
+      __m256i p1 = _mm256_packus_epi16(row2, row3);
+      __m256i p2 = _mm256_packus_epi16(row4, row5);
+      __m256i p3 = _mm256_packus_epi16(row6, row7);
+
+      // 8bit 8x8 transpose pass 1
+      dct_interleave8(p0, p2); // a0e0a1e1...
+      dct_interleave8(p1, p3); // c0g0c1g1...
+
+      // transpose pass 2
+      dct_interleave8(p0, p1); // a0c0e0g0...
+      dct_interleave8(p2, p3); // b0d0f0h0...
+
+      // transpose pass 3
+      dct_interleave8(p0, p2); // a0b0c0d0...
+      dct_interleave8(p1, p3); // a4b4c4d4...
+
+      // store
+      dct_store(p0);
+      dct_store(_mm256_shuffle_epi32(p0, 0x4e));
+      dct_store(p2);
+      dct_store(_mm256_shuffle_epi32(p2, 0x4e));
+      dct_store(p1);
+      dct_store(_mm256_shuffle_epi32(p1, 0x4e));
+      dct_store(p3);
+      dct_store(_mm256_shuffle_epi32(p3, 0x4e));
+   }
+
+#undef dct_const
+#undef dct_rot
+#undef dct_widen
+#undef dct_wadd
+#undef dct_wsub
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+#undef dct_load
+#undef dct_store
+}
+
+#endif // STBI_AVX2
+
 #ifdef STBI_NEON
 
 // NEON integer IDCT. should produce bit-identical
@@ -2622,6 +3145,43 @@ static stbi_uc stbi__get_marker(stbi__jpeg *j)
 // of the components is specified by order[]
 #define STBI__RESTART(x)     ((x) >= 0xd0 && (x) <= 0xd7)
 
+// where the idct of block (bx,by) of component n goes; reduced decodes pack
+// the smaller blocks together, see stbi__process_frame_header
+static stbi_uc *stbi__jpeg_block_out(stbi__jpeg *z, int n, int bx, int by)
+{
+   int bs = 8 >> z->scale_shift;
+   return z->img_comp[n].data + (z->img_comp[n].w2 >> z->scale_shift)*by*bs + bx*bs;
+}
+
+// decode the next baseline block of component n and write its pixels to
+// block (bx,by). at 1/8 scale each block is a single pixel, which is just
+// the DC term, so the AC terms are never dequantized or transformed
+static int stbi__jpeg_decode_put_block(stbi__jpeg *z, int n, int bx, int by, short data[64])
+{
+   int ha = z->img_comp[n].ha;
+   stbi_uc *out = stbi__jpeg_block_out(z, n, bx, by);
+   if (z->scale_shift == 3) {
+      int dc;
+      if (!stbi__jpeg_decode_block_dc_only(z, &dc, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+      out[0] = stbi__clamp(((dc + 4) >> 3) + 128);
+   } else {
+      if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+      z->idct_block_kernel(out, z->img_comp[n].w2 >> z->scale_shift, data);
+   }
+   return 1;
+}
+
+// decode blocks (bx,by) and (bx+1,by) of component n, then transform both
+// with one call to the two-block IDCT; data holds 128 coefficients
+static int stbi__jpeg_decode_put_block2(stbi__jpeg *z, int n, int bx, int by, short *data)
+{
+   int ha = z->img_comp[n].ha;
+   if (!stbi__jpeg_decode_block(z, data   , z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+   if (!stbi__jpeg_decode_block(z, data+64, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+   z->idct_block2_kernel(stbi__jpeg_block_out(z, n, bx, by), stbi__jpeg_block_out(z, n, bx+1, by), z->img_comp[n].w2, data, data+64);
+   return 1;
+}
+
 // after a restart interval, stbi__jpeg_reset the entropy decoder and
 // the dc prediction
 static void stbi__jpeg_reset(stbi__jpeg *j)
@@ -2637,9 +3197,170 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
+#ifdef STBI__THREADS
+// baseline only: decode MCUs first..last-1 of the current scan, with no
+// restart handling. this is the serial loop below, one MCU at a time
+static int stbi__jpeg_decode_mcu_range(stbi__jpeg *z, int first, int last)
+{
+   int m,k,x,y;
+   STBI_SIMD_ALIGN(short, data[128]);
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      int w = (z->img_comp[n].x+7) >> 3;
+      for (m=first; m < last; ++m)
+         if (!stbi__jpeg_decode_put_block(z, n, m % w, m / w, data)) return 0;
+      return 1;
+   }
+   for (m=first; m < last; ++m) {
+      int i = m % z->img_mcu_x, j = m / z->img_mcu_x;
+      for (k=0; k < z->scan_n; ++k) {
+         int n = z->order[k];
+         for (y=0; y < z->img_comp[n].v; ++y) {
+            int y2 = (j*z->img_comp[n].v + y);
+            if (z->img_comp[n].h == 2 && z->idct_block2_kernel) {
+               if (!stbi__jpeg_decode_put_block2(z, n, i*2, y2, data)) return 0;
+               continue;
+            }
+            for (x=0; x < z->img_comp[n].h; ++x)
+               if (!stbi__jpeg_decode_put_block(z, n, i*z->img_comp[n].h + x, y2, data)) return 0;
+         }
+      }
+   }
+   return 1;
+}
+
+typedef struct
+{
+   stbi__jpeg *z;              // shared, read only: tables and output planes
+   stbi_uc **seg;              // start of each restart interval, and the end
+   int first_seg, last_seg;    // this job's intervals
+   int mcus;                   // MCUs in the scan
+   int ok;
+   const char *failure;        // the failure reason, which is per thread
+} stbi__jpeg_job;
+
+static void *stbi__jpeg_job_run(void *arg)
+{
+   stbi__jpeg_job *job = (stbi__jpeg_job *) arg;
+   stbi__jpeg *z = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+   stbi__context s;
+   int k, ri = job->z->restart_interval;
+   job->ok = 0;
+   if (z == NULL) {
+      stbi__err("outofmem", "Out of memory");
+      job->failure = stbi__g_failure_reason;
+      return NULL;
+   }
+   // private copies of the decoder and of the input context; blocks of
+   // different intervals never overlap in the output planes
+   memcpy(z, job->z, sizeof(*z));
+   memcpy(&s, job->z->s, sizeof(s));
+   z->s = &s;
+   for (k=job->first_seg; k < job->last_seg; ++k) {
+      int last = (k+1) * ri < job->mcus ? (k+1) * ri : job->mcus;
+      s.img_buffer = job->seg[k];
+      s.img_buffer_end = job->seg[k+1];
+      stbi__jpeg_reset(z);
+      if (!stbi__jpeg_decode_mcu_range(z, k * ri, last)) {
+         job->failure = stbi__g_failure_reason;
+         STBI_FREE(z);
+         return NULL;
+      }
+   }
+   STBI_FREE(z);
+   job->ok = 1;
+   return NULL;
+}
+
+// decode a baseline scan on several threads, one run of restart intervals
+// per thread. returns -1 without consuming anything when the scan is better
+// (or only) decoded serially: not in memory, too small, or the restart
+// markers are not where they should be
+static int stbi__jpeg_decode_parallel(stbi__jpeg *z)
+{
+   stbi__jpeg_job job[STBI_MAX_THREADS];
+   pthread_t thread[STBI_MAX_THREADS];
+   int started[STBI_MAX_THREADS];
+   stbi_uc **seg, *p, *e;
+   int mcus, nseg, found, threads, i, ok;
+
+   if (z->s->read_from_callbacks) return -1;
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      mcus = ((z->img_comp[n].x+7) >> 3) * ((z->img_comp[n].y+7) >> 3);
+   } else
+      mcus = z->img_mcu_x * z->img_mcu_y;
+   nseg = (mcus + z->restart_interval - 1) / z->restart_interval;
+   threads = stbi__thread_count();
+   if (threads > nseg) threads = nseg;
+   // below a few hundred thousand pixels, starting threads costs more than it saves
+   if (threads < 2 || mcus < 1024) return -1;
+
+   // find the intervals: RSTn markers cycle through 0..7; anything else but
+   // stuffing and fill bytes ends the scan
+   seg = (stbi_uc **) stbi__malloc(sizeof(*seg) * (nseg + 1));
+   if (seg == NULL) return -1;
+   p = z->s->img_buffer;
+   e = z->s->img_buffer_end;
+   seg[0] = p;
+   found = 1;
+   for (;;) {
+      p = (stbi_uc *) memchr(p, 0xff, e - p);
+      if (p == NULL || p+1 >= e) { p = e; break; }
+      if (p[1] == 0x00 || p[1] == 0xff) { p += 1 + (p[1] == 0x00); continue; }
+      if (!STBI__RESTART(p[1])) break;
+      if (found == nseg || p[1] != 0xd0 + ((found-1) & 7)) { found = -1; break; }
+      seg[found++] = p += 2;
+   }
+   if (found != nseg) {
+      STBI_FREE(seg);
+      return -1;
+   }
+   seg[nseg] = p;
+
+   for (i=0; i < threads; ++i) {
+      job[i].z = z;
+      job[i].seg = seg;
+      job[i].first_seg = (int) ((long long) nseg * i / threads);
+      job[i].last_seg = (int) ((long long) nseg * (i+1) / threads);
+      job[i].mcus = mcus;
+      job[i].ok = 0;
+   }
+   // the calling thread takes the first job itself
+   for (i=1; i < threads; ++i)
+      started[i] = pthread_create(&thread[i], NULL, stbi__jpeg_job_run, &job[i]) == 0;
+   stbi__jpeg_job_run(&job[0]);
+   ok = job[0].ok;
+   for (i=1; i < threads; ++i) {
+      if (started[i])
+         pthread_join(thread[i], NULL);
+      else
+         stbi__jpeg_job_run(&job[i]);
+      ok &= job[i].ok;
+   }
+   STBI_FREE(seg);
+   for (i=0; i < threads; ++i)
+      if (!job[i].ok) {
+         stbi__g_failure_reason = job[i].failure;
+         break;
+      }
+
+   // leave the input at the marker after the scan, as the serial decoder does
+   z->s->img_buffer = p;
+   stbi__jpeg_reset(z);
+   return ok;
+}
+#endif // STBI__THREADS
+
 static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 {
    stbi__jpeg_reset(z);
+   #ifdef STBI__THREADS
+   if (!z->progressive && z->restart_interval) {
+      int r = stbi__jpeg_decode_parallel(z);
+      if (r >= 0) return r;
+   }
+   #endif
    if (!z->progressive) {
       if (z->scan_n == 1) {
          int i,j;
@@ -2653,9 +3374,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
          int h = (z->img_comp[n].y+7) >> 3;
          for (j=0; j < h; ++j) {
             for (i=0; i < w; ++i) {
-               int ha = z->img_comp[n].ha;
-               if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               if (!stbi__jpeg_decode_put_block(z, n, i, j, data)) return 0;
                // every data block is an MCU, so countdown the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
@@ -2669,7 +3388,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
          return 1;
       } else { // interleaved
          int i,j,k,x,y;
-         STBI_SIMD_ALIGN(short, data[64]);
+         STBI_SIMD_ALIGN(short, data[128]);
          for (j=0; j < z->img_mcu_y; ++j) {
             for (i=0; i < z->img_mcu_x; ++i) {
                // scan an interleaved mcu... process scan_n components in order
@@ -2678,12 +3397,14 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   // scan out an mcu's worth of this component; that's just determined
                   // by the basic H and V specified for the component
                   for (y=0; y < z->img_comp[n].v; ++y) {
+                     int y2 = (j*z->img_comp[n].v + y);
+                     if (z->img_comp[n].h == 2 && z->idct_block2_kernel) {
+                        if (!stbi__jpeg_decode_put_block2(z, n, i*2, y2, data)) return 0;
+                        continue;
+                     }
                      for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x)*8;
-                        int y2 = (j*z->img_comp[n].v + y)*8;
-                        int ha = z->img_comp[n].ha;
-                        if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                        z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
+                        int x2 = (i*z->img_comp[n].h + x);
+                        if (!stbi__jpeg_decode_put_block(z, n, x2, y2, data)) return 0;
                      }
                   }
                }
@@ -2761,6 +3482,50 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
    }
 }
 
+// highest zigzag index a reduced IDCT reads, by scale_shift: the last
+// coefficient of the top-left 8x8, 4x4, 2x2 and 1x1 corner
+static int const stbi__jpeg_zig_needed[4] = { 63, 24, 4, 0 };
+
+// decide whether a progressive scan contributes to a reduced decode. bands
+// that start above what the reduced IDCT reads are skipped, and so are later
+// refinements overlapping them: a refinement's bitstream depends on which
+// coefficients are already nonzero, which is unknown once a band is missed
+static int stbi__jpeg_scan_needed(stbi__jpeg *z)
+{
+   int k, needed = 1;
+   if (!z->progressive) return 1;
+   for (k=0; k < z->scan_n; ++k) {
+      int n = z->order[k];
+      if (z->spec_start > stbi__jpeg_zig_needed[z->scale_shift])
+         needed = 0;
+      if (z->succ_high && z->spec_end >= z->img_comp[n].skipped_from)
+         needed = 0;
+   }
+   if (!needed)
+      for (k=0; k < z->scan_n; ++k) {
+         int n = z->order[k];
+         if (z->spec_start < z->img_comp[n].skipped_from)
+            z->img_comp[n].skipped_from = z->spec_start;
+      }
+   return needed;
+}
+
+// skip the entropy-coded data of a scan, up to the first non-restart marker
+static void stbi__jpeg_skip_entropy_coded_data(stbi__jpeg *z)
+{
+   while (!stbi__at_eof(z->s)) {
+      int x = stbi__get8(z->s);
+      if (x == 0xff) {
+         int c = stbi__get8(z->s);
+         while (c == 0xff) c = stbi__get8(z->s); // consume fill bytes
+         if (c != 0 && !STBI__RESTART(c)) {
+            z->marker = (unsigned char) c;
+            return;
+         }
+      }
+   }
+}
+
 static void stbi__jpeg_dequantize(short *data, stbi__uint16 *dequant)
 {
    int i;
@@ -2780,7 +3545,14 @@ static void stbi__jpeg_finish(stbi__jpeg *z)
             for (i=0; i < w; ++i) {
                short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
                stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               if (z->idct_block2_kernel && i+1 < w) {
+                  // the next block's coefficients follow this one's
+                  stbi__jpeg_dequantize(data+64, z->dequant[z->img_comp[n].tq]);
+                  z->idct_block2_kernel(stbi__jpeg_block_out(z, n, i, j), stbi__jpeg_block_out(z, n, i+1, j), z->img_comp[n].w2, data, data+64);
+                  ++i;
+                  continue;
+               }
+               z->idct_block_kernel(stbi__jpeg_block_out(z, n, i, j), z->img_comp[n].w2 >> z->scale_shift, data);
             }
          }
       }
@@ -3015,7 +3787,10 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       z->img_comp[i].coeff = 0;
       z->img_comp[i].raw_coeff = 0;
       z->img_comp[i].linebuf = NULL;
-      z->img_comp[i].raw_data = stbi__malloc_mad2(z->img_comp[i].w2, z->img_comp[i].h2, 15);
+      z->img_comp[i].skipped_from = 64;
+      // a reduced decode only needs (w2,h2) >> scale_shift pixels; w2 and h2
+      // are multiples of 8 so this is exact
+      z->img_comp[i].raw_data = stbi__malloc_mad2(z->img_comp[i].w2 >> z->scale_shift, z->img_comp[i].h2 >> z->scale_shift, 15);
       if (z->img_comp[i].raw_data == NULL)
          return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
       // align blocks for idct using mmx/sse
@@ -3081,7 +3856,11 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
    while (!stbi__EOI(m)) {
       if (stbi__SOS(m)) {
          if (!stbi__process_scan_header(j)) return 0;
-         if (!stbi__parse_entropy_coded_data(j)) return 0;
+         if (!stbi__jpeg_scan_needed(j)) {
+            // reduced decodes are done once the low frequencies are in; the
+            // remaining scans are just stepped over instead of decoded
+            stbi__jpeg_skip_entropy_coded_data(j);
+         } else if (!stbi__parse_entropy_coded_data(j)) return 0;
          if (j->marker == STBI__MARKER_none ) {
             // handle 0s at the end of image data from IP Kamera 9060
             while (!stbi__at_eof(j->s)) {
@@ -3479,10 +4258,84 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
 }
 #endif
 
+#ifdef STBI_AVX2
+// 16 pixels per iteration version of the sse2 step == 4 path; what is left
+// over, and step == 3, is handed to stbi__YCbCr_to_RGB_simd
+static STBI__AVX2_TARGET void stbi__YCbCr_to_RGB_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   int i = 0;
+
+   if (step == 4) {
+      __m256i signflip  = _mm256_set1_epi8(-0x80);
+      __m256i cr_const0 = _mm256_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+      __m256i cr_const1 = _mm256_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+      __m256i cb_const0 = _mm256_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+      __m256i cb_const1 = _mm256_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+      __m256i y_bias = _mm256_set1_epi8((char) (unsigned char) 128);
+      __m256i xw = _mm256_set1_epi16(255); // alpha channel
+
+      // pixels 0-7 go to the low half of the low lane, 8-15 to the low half
+      // of the high lane, so the in-lane unpacks below work like the sse2 ones
+      #define ycc_load(p) \
+         _mm256_permute4x64_epi64(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (p))), 0x50)
+
+      for (; i+15 < count; i += 16) {
+         // load
+         __m256i y_bytes = ycc_load(y+i);
+         __m256i cr_bytes = ycc_load(pcr+i);
+         __m256i cb_bytes = ycc_load(pcb+i);
+         __m256i cr_biased = _mm256_xor_si256(cr_bytes, signflip); // -128
+         __m256i cb_biased = _mm256_xor_si256(cb_bytes, signflip); // -128
+
+         // unpack to short (and left-shift cr, cb by 8)
+         __m256i yw  = _mm256_unpacklo_epi8(y_bias, y_bytes);
+         __m256i crw = _mm256_unpacklo_epi8(_mm256_setzero_si256(), cr_biased);
+         __m256i cbw = _mm256_unpacklo_epi8(_mm256_setzero_si256(), cb_biased);
+
+         // color transform
+         __m256i yws = _mm256_srli_epi16(yw, 4);
+         __m256i cr0 = _mm256_mulhi_epi16(cr_const0, crw);
+         __m256i cb0 = _mm256_mulhi_epi16(cb_const0, cbw);
+         __m256i cb1 = _mm256_mulhi_epi16(cbw, cb_const1);
+         __m256i cr1 = _mm256_mulhi_epi16(crw, cr_const1);
+         __m256i rws = _mm256_add_epi16(cr0, yws);
+         __m256i gwt = _mm256_add_epi16(cb0, yws);
+         __m256i bws = _mm256_add_epi16(yws, cb1);
+         __m256i gws = _mm256_add_epi16(gwt, cr1);
+
+         // descale
+         __m256i rw = _mm256_srai_epi16(rws, 4);
+         __m256i bw = _mm256_srai_epi16(bws, 4);
+         __m256i gw = _mm256_srai_epi16(gws, 4);
+
+         // back to byte, set up for transpose
+         __m256i brb = _mm256_packus_epi16(rw, bw);
+         __m256i gxb = _mm256_packus_epi16(gw, xw);
+
+         // transpose to interleave channels; o0 has pixels 0-3 and 8-11,
+         // o1 has 4-7 and 12-15
+         __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+         __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+         __m256i o0 = _mm256_unpacklo_epi16(t0, t1);
+         __m256i o1 = _mm256_unpackhi_epi16(t0, t1);
+
+         // store
+         _mm256_storeu_si256((__m256i *) (out + 0), _mm256_permute2x128_si256(o0, o1, 0x20));
+         _mm256_storeu_si256((__m256i *) (out + 32), _mm256_permute2x128_si256(o0, o1, 0x31));
+         out += 64;
+      }
+      #undef ycc_load
+   }
+
+   stbi__YCbCr_to_RGB_simd(out, y+i, pcb+i, pcr+i, count-i, step);
+}
+#endif
+
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
    j->idct_block_kernel = stbi__idct_block;
+   j->idct_block2_kernel = NULL;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
 
@@ -3494,11 +4347,30 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
    }
 #endif
 
+#ifdef STBI_AVX2
+   if (stbi__sse2_available() && stbi__avx2_available()) {
+      j->idct_block2_kernel = stbi__idct_avx2;
+      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_avx2;
+   }
+#endif
+
 #ifdef STBI_NEON
    j->idct_block_kernel = stbi__idct_simd;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
 #endif
+
+   j->scale_shift = 0;
+}
+
+// switch to the reduced-size IDCT for a 1/(1<<shift) decode
+static void stbi__setup_jpeg_reduced(stbi__jpeg *j, int shift)
+{
+   j->scale_shift = shift;
+   if (shift) j->idct_block2_kernel = NULL;
+   if      (shift == 1) j->idct_block_kernel = stbi__idct_block_4x4;
+   else if (shift == 2) j->idct_block_kernel = stbi__idct_block_2x2;
+   else if (shift == 3) j->idct_block_kernel = stbi__idct_block_1x1;
 }
 
 // clean up the temporary component buffers
@@ -3535,6 +4407,20 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
    // load a jpeg image from whichever source, but leave in YCbCr format
    if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
 
+   // a reduced decode left smaller blocks behind; shrink the geometry to
+   // match so upsampling and colour conversion work on it unchanged
+   if (z->scale_shift) {
+      int k, s = z->scale_shift, r = (1 << s) - 1;
+      z->s->img_x = (z->s->img_x + r) >> s;
+      z->s->img_y = (z->s->img_y + r) >> s;
+      for (k=0; k < z->s->img_n; ++k) {
+         z->img_comp[k].x = (z->img_comp[k].x + r) >> s;
+         z->img_comp[k].y = (z->img_comp[k].y + r) >> s;
+         z->img_comp[k].w2 >>= s;
+         z->img_comp[k].h2 >>= s;
+      }
+   }
+
    // determine actual number of components to generate
    n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
 
@@ -3690,6 +4576,7 @@ static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int re
    STBI_NOTUSED(ri);
    j->s = s;
    stbi__setup_jpeg(j);
+   stbi__setup_jpeg_reduced(j, stbi__reduce_on_load);
    result = load_jpeg_image(j, x,y,comp,req_comp);
    STBI_FREE(j);
    return result;
@@ -3740,9 +4627,15 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 #ifndef STBI_NO_ZLIB
 
 // fast-way is faster to check than jpeg huffman, but slow way is slower
-#define STBI__ZFAST_BITS  9 // accelerate all cases in default tables
+#define STBI__ZFAST_BITS  11 // accelerate all cases in default tables, and most in dynamic ones
 #define STBI__ZFAST_MASK  ((1 << STBI__ZFAST_BITS) - 1)
 
+// refill the bit buffer a whole word at a time where unaligned little-endian
+// loads are cheap; elsewhere it is filled a byte at a time
+#if defined(_MSC_VER) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define STBI__ZWORD_REFILL
+#endif
+
 // zlib-style huffman encoding
 // (jpegs packs from left, zlib from right, so can't share code)
 typedef struct
@@ -3829,12 +4722,22 @@ typedef struct
 {
    stbi_uc *zbuffer, *zbuffer_end;
    int num_bits;
-   stbi__uint32 code_buffer;
+   int num_pad;  // zero bits fed in past the end of the input, see stbi__fill_bits
+   stbi__uint64 code_buffer;
 
    char *zout;
    char *zout_start;
    char *zout_end;
    int   z_expandable;
+   int   z_truncate; // only a prefix of the output is wanted; stop when full
+   int   z_full;     // set when a truncated decode stopped early
+
+   // streaming: output is handed to z_row in z_row_len-sized pieces and the
+   // buffer only keeps the unconsumed part plus 32k of history
+   int (*z_row)(void *user, stbi_uc *row);
+   void *z_row_user;
+   int   z_row_len;
+   char *z_consumed;
 
    stbi__zhuffman z_length, z_distance;
 } stbi__zbuf;
@@ -3845,20 +4748,35 @@ stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
    return *z->zbuffer++;
 }
 
+// tops the bit buffer up to at least 56 bits, which is enough for a whole
+// length/distance pair. Past the end of the input it is padded with zeros
+// (counted in num_pad); the word refill may also leave copies of the next
+// input bytes above num_bits, which is harmless as the same bytes get ORed
+// into the same positions when they are loaded for real
 static void stbi__fill_bits(stbi__zbuf *z)
 {
+#ifdef STBI__ZWORD_REFILL
+   if (z->zbuffer_end - z->zbuffer >= 8) {
+      stbi__uint64 w;
+      memcpy(&w, z->zbuffer, 8);
+      z->code_buffer |= w << z->num_bits;
+      z->zbuffer += (63 - z->num_bits) >> 3;
+      z->num_bits |= 56;
+      return;
+   }
+#endif
    do {
-      STBI_ASSERT(z->code_buffer < (1U << z->num_bits));
-      z->code_buffer |= (unsigned int) stbi__zget8(z) << z->num_bits;
+      if (z->zbuffer >= z->zbuffer_end) z->num_pad += 8;
+      z->code_buffer |= (stbi__uint64) stbi__zget8(z) << z->num_bits;
       z->num_bits += 8;
-   } while (z->num_bits <= 24);
+   } while (z->num_bits <= 56);
 }
 
 stbi_inline static unsigned int stbi__zreceive(stbi__zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) stbi__fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
+   k = (unsigned int) (z->code_buffer & ((1 << n) - 1));
    z->code_buffer >>= n;
    z->num_bits -= n;
    return k;
@@ -3869,7 +4787,7 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
    int b,s,k;
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = stbi__bit_reverse(a->code_buffer, 16);
+   k = stbi__bit_reverse((int) (a->code_buffer & 0xffff), 16);
    for (s=STBI__ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
@@ -3896,13 +4814,41 @@ stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
    return stbi__zhuffman_decode_slowpath(a, z);
 }
 
+// pass every complete row of a streaming decode to its consumer
+static int stbi__zflush_rows(stbi__zbuf *z)
+{
+   while (z->zout - z->z_consumed >= z->z_row_len) {
+      if (!z->z_row(z->z_row_user, (stbi_uc *) z->z_consumed)) return 0;
+      z->z_consumed += z->z_row_len;
+   }
+   return 1;
+}
+
 static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room for n bytes
 {
    char *q;
-   int cur, limit, old_limit;
+   int cur, limit, old_limit, consumed;
    z->zout = zout;
+   if (z->z_truncate) { z->z_full = 1; return 0; }
+   if (z->z_row) {
+      // streaming: drain finished rows, then slide the window down to what
+      // is still unconsumed or within reach of a back-reference
+      int keep;
+      if (!stbi__zflush_rows(z)) return 0;
+      cur  = (int) (z->zout - z->zout_start);
+      keep = cur > 32768 ? cur - 32768 : 0;
+      consumed = (int) (z->z_consumed - z->zout_start);
+      if (consumed < keep) keep = consumed;
+      if (keep) {
+         memmove(z->zout_start, z->zout_start + keep, cur - keep);
+         z->zout       -= keep;
+         z->z_consumed -= keep;
+      }
+      if (z->zout + n <= z->zout_end) return 1;
+   }
    if (!z->z_expandable) return stbi__err("output buffer limit","Corrupt PNG");
    cur   = (int) (z->zout     - z->zout_start);
+   consumed = (int) (z->z_consumed - z->zout_start);
    limit = old_limit = (int) (z->zout_end - z->zout_start);
    while (cur + n > limit)
       limit *= 2;
@@ -3912,6 +4858,7 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
    z->zout_start = q;
    z->zout       = q + cur;
    z->zout_end   = q + limit;
+   z->z_consumed = q + consumed;
    return 1;
 }
 
@@ -3933,14 +4880,33 @@ static int stbi__parse_huffman_block(stbi__zbuf *a)
 {
    char *zout = a->zout;
    for(;;) {
-      int z = stbi__zhuffman_decode(a, &a->z_length);
+      int z;
+      // one refill covers a whole length/distance pair, or a literal plus
+      // the two fast-table literals tried below
+      if (a->num_bits < 48) stbi__fill_bits(a);
+      z = stbi__zhuffman_decode(a, &a->z_length);
       if (z < 256) {
+         int b;
          if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
          if (zout >= a->zout_end) {
             if (!stbi__zexpand(a, zout, 1)) return 0;
             zout = a->zout;
          }
          *zout++ = (char) z;
+         // literals tend to come in runs; take up to two more straight from
+         // the fast table without going back around the loop
+         b = a->z_length.fast[a->code_buffer & STBI__ZFAST_MASK];
+         if (b && (b & 511) < 256 && zout < a->zout_end) {
+            a->code_buffer >>= b >> 9;
+            a->num_bits -= b >> 9;
+            *zout++ = (char) b;
+            b = a->z_length.fast[a->code_buffer & STBI__ZFAST_MASK];
+            if (b && (b & 511) < 256 && zout < a->zout_end) {
+               a->code_buffer >>= b >> 9;
+               a->num_bits -= b >> 9;
+               *zout++ = (char) b;
+            }
+         }
       } else {
          stbi_uc *p;
          int len,dist;
@@ -3957,13 +4923,31 @@ static int stbi__parse_huffman_block(stbi__zbuf *a)
          if (stbi__zdist_extra[z]) dist += stbi__zreceive(a, stbi__zdist_extra[z]);
          if (zout - a->zout_start < dist) return stbi__err("bad dist","Corrupt PNG");
          if (zout + len > a->zout_end) {
+            if (a->z_truncate) {
+               // copy the part of the match that still fits, then stop
+               p = (stbi_uc *) (zout - dist);
+               while (zout < a->zout_end) *zout++ = *p++;
+               a->zout = zout;
+               a->z_full = 1;
+               return 0;
+            }
             if (!stbi__zexpand(a, zout, len)) return 0;
             zout = a->zout;
          }
          p = (stbi_uc *) (zout - dist);
          if (dist == 1) { // run of one byte; common in images.
-            stbi_uc v = *p;
-            if (len) { do *zout++ = v; while (--len); }
+            memset(zout, *p, len);
+            zout += len;
+         } else if (dist >= 8 && a->zout_end - zout >= len + 7) {
+            // 8 bytes at a time; the source is always at least a word behind,
+            // and the up to 7 bytes written past the match get overwritten later
+            char *end = zout + len;
+            do {
+               memcpy(zout, p, 8);
+               zout += 8;
+               p += 8;
+            } while (zout < end);
+            zout = end;
          } else {
             if (len) { do *zout++ = *p++; while (--len); }
          }
@@ -4026,23 +5010,29 @@ static int stbi__parse_uncompressed_block(stbi__zbuf *a)
    int len,nlen,k;
    if (a->num_bits & 7)
       stbi__zreceive(a, a->num_bits & 7); // discard
-   // drain the bit-packed data into header
-   k = 0;
-   while (a->num_bits > 0) {
-      header[k++] = (stbi_uc) (a->code_buffer & 255); // suppress MSVC run-time check
-      a->code_buffer >>= 8;
-      a->num_bits -= 8;
-   }
-   STBI_ASSERT(a->num_bits == 0);
-   // now fill header the normal way
-   while (k < 4)
-      header[k++] = stbi__zget8(a);
+   // the bit buffer can run well past the block header; hand the whole bytes
+   // it holds (minus any end-of-input padding) back to the input and read
+   // the header from there
+   k = a->num_bits - (a->num_pad < a->num_bits ? a->num_pad : a->num_bits);
+   a->zbuffer -= k >> 3;
+   a->code_buffer = 0;
+   a->num_bits = 0;
+   a->num_pad = 0;
+   for (k=0; k < 4; ++k)
+      header[k] = stbi__zget8(a);
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return stbi__err("zlib corrupt","Corrupt PNG");
    if (a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
-   if (a->zout + len > a->zout_end)
+   if (a->zout + len > a->zout_end) {
+      if (a->z_truncate) {
+         memcpy(a->zout, a->zbuffer, a->zout_end - a->zout);
+         a->zout = a->zout_end;
+         a->z_full = 1;
+         return 0;
+      }
       if (!stbi__zexpand(a, a->zout, len)) return 0;
+   }
    memcpy(a->zout, a->zbuffer, len);
    a->zbuffer += len;
    a->zout += len;
@@ -4097,6 +5087,7 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
    if (parse_header)
       if (!stbi__parse_zlib_header(a)) return 0;
    a->num_bits = 0;
+   a->num_pad = 0;
    a->code_buffer = 0;
    do {
       final = stbi__zreceive(a,1);
@@ -4125,10 +5116,45 @@ static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->z_truncate = 0;
+   a->z_row = NULL;
+   a->z_consumed = obuf;
 
    return stbi__parse_zlib(a, parse_header);
 }
 
+// inflate in a sliding window, handing the output to a->z_row one
+// a->z_row_len piece at a time; a partial piece at the end is dropped
+static int stbi__do_zlib_rows(stbi__zbuf *a, char *obuf, int olen, int parse_header)
+{
+   a->zout_start = obuf;
+   a->zout       = obuf;
+   a->zout_end   = obuf + olen;
+   a->z_expandable = 1;
+   a->z_truncate = 0;
+   a->z_consumed = obuf;
+
+   if (!stbi__parse_zlib(a, parse_header)) return 0;
+   return stbi__zflush_rows(a);
+}
+
+// inflate just the first olen bytes of the stream; returns the number of
+// bytes produced (less than olen only if the stream is shorter), or -1
+static int stbi__do_zlib_prefix(stbi__zbuf *a, char *obuf, int olen, int parse_header)
+{
+   a->zout_start = obuf;
+   a->zout       = obuf;
+   a->zout_end   = obuf + olen;
+   a->z_expandable = 0;
+   a->z_truncate = 1;
+   a->z_full = 0;
+   a->z_row = NULL;
+   a->z_consumed = obuf;
+
+   if (!stbi__parse_zlib(a, parse_header) && !a->z_full) return -1;
+   return (int) (a->zout - a->zout_start);
+}
+
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen)
 {
    stbi__zbuf a;
@@ -4244,6 +5270,7 @@ typedef struct
    stbi__context *s;
    stbi_uc *idata, *expanded, *out;
    int depth;
+   int simd; // use stbi__png_unfilter_row_simd for 8-bit rgb/rgba rows
 } stbi__png;
 
 
@@ -4280,13 +5307,159 @@ static int stbi__paeth(int a, int b, int c)
 
 static stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
-// create the png data from post-deflated data
-static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+// Sub, Avg and Paeth each depend on the pixel just decoded to the left, so
+// the parallelism is across the channels of one pixel: each step works on a
+// single 3- or 4-byte pixel held in the low lanes of a vector, moved in and
+// out as a 32-bit word. with 3-byte pixels those words overlap the next
+// pixel, so the last pixel of a row goes through a scratch copy instead.
+
+#ifdef STBI_SSE2
+typedef __m128i stbi__png_vec;
+
+static stbi__png_vec stbi__png_vload(stbi_uc const *p)
+{
+   int v;
+   memcpy(&v, p, 4);
+   return _mm_cvtsi32_si128(v);
+}
+
+static void stbi__png_vstore(stbi_uc *p, stbi__png_vec x)
+{
+   int v = _mm_cvtsi128_si32(x);
+   memcpy(p, &v, 4);
+}
+
+#define stbi__png_vzero()     _mm_setzero_si128()
+#define stbi__png_valpha()    _mm_cvtsi32_si128((int) 0xff000000)
+#define stbi__png_vadd(x,y)   _mm_add_epi8(x,y)
+#define stbi__png_vor(x,y)    _mm_or_si128(x,y)
+
+static stbi__png_vec stbi__png_vavg(stbi__png_vec a, stbi__png_vec b)
+{
+   // pavgb rounds up; png wants (a+b)>>1
+   __m128i odd = _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1));
+   return _mm_sub_epi8(_mm_avg_epu8(a, b), odd);
+}
+
+static stbi__png_vec stbi__png_vpaeth(stbi__png_vec a, stbi__png_vec b, stbi__png_vec c)
+{
+   // pa = |b-c|, pb = |a-c|, pc = |a+b-2c|; pick a, then b, then c on ties
+   __m128i zero = _mm_setzero_si128();
+   __m128i aw = _mm_unpacklo_epi8(a, zero);
+   __m128i bw = _mm_unpacklo_epi8(b, zero);
+   __m128i cw = _mm_unpacklo_epi8(c, zero);
+   __m128i da = _mm_sub_epi16(bw, cw);
+   __m128i db = _mm_sub_epi16(aw, cw);
+   __m128i dc = _mm_add_epi16(da, db);
+   __m128i pa = _mm_max_epi16(da, _mm_sub_epi16(zero, da));
+   __m128i pb = _mm_max_epi16(db, _mm_sub_epi16(zero, db));
+   __m128i pc = _mm_max_epi16(dc, _mm_sub_epi16(zero, dc));
+   __m128i sm = _mm_min_epi16(_mm_min_epi16(pa, pb), pc);
+   __m128i ua = _mm_cmpeq_epi16(pa, sm);
+   __m128i ub = _mm_cmpeq_epi16(pb, sm);
+   __m128i bc = _mm_or_si128(_mm_and_si128(ub, bw), _mm_andnot_si128(ub, cw));
+   __m128i pr = _mm_or_si128(_mm_and_si128(ua, aw), _mm_andnot_si128(ua, bc));
+   return _mm_packus_epi16(pr, zero);
+}
+#else // STBI_NEON
+typedef uint8x8_t stbi__png_vec;
+
+static stbi__png_vec stbi__png_vload(stbi_uc const *p)
+{
+   stbi__uint32 v;
+   memcpy(&v, p, 4);
+   return vreinterpret_u8_u32(vdup_n_u32(v));
+}
+
+static void stbi__png_vstore(stbi_uc *p, stbi__png_vec x)
+{
+   stbi__uint32 v = vget_lane_u32(vreinterpret_u32_u8(x), 0);
+   memcpy(p, &v, 4);
+}
+
+#define stbi__png_vzero()     vdup_n_u8(0)
+#define stbi__png_valpha()    vset_lane_u8(255, vdup_n_u8(0), 3)
+#define stbi__png_vadd(x,y)   vadd_u8(x,y)
+#define stbi__png_vor(x,y)    vorr_u8(x,y)
+#define stbi__png_vavg(x,y)   vhadd_u8(x,y)
+
+static stbi__png_vec stbi__png_vpaeth(stbi__png_vec a, stbi__png_vec b, stbi__png_vec c)
+{
+   // pa = |b-c|, pb = |a-c|, pc = |a+b-2c|; pick a, then b, then c on ties
+   uint16x8_t pa = vabdl_u8(b, c);
+   uint16x8_t pb = vabdl_u8(a, c);
+   int16x8_t  dc = vaddq_s16(vreinterpretq_s16_u16(vsubl_u8(b, c)), vreinterpretq_s16_u16(vsubl_u8(a, c)));
+   uint16x8_t pc = vreinterpretq_u16_s16(vabsq_s16(dc));
+   uint16x8_t sm = vminq_u16(vminq_u16(pa, pb), pc);
+   uint8x8_t  ua = vmovn_u16(vceqq_u16(pa, sm));
+   uint8x8_t  ub = vmovn_u16(vceqq_u16(pb, sm));
+   return vbsl_u8(ua, a, vbsl_u8(ub, b, c));
+}
+#endif
+
+// unfilter n pixels; a and c carry the left and upper-left pixels in and
+// out. raw advances by img_n, cur and prior by out_n, and alpha is or'd
+// into every output pixel (set when expanding rgb to rgba)
+static void stbi__png_unfilter_simd_run(stbi_uc *cur, stbi_uc const *prior, stbi_uc const *raw, int filter, int n, int img_n, int out_n,
+                                        stbi__png_vec alpha, stbi__png_vec *pa, stbi__png_vec *pc)
+{
+   stbi__png_vec x, b, a = *pa, c = *pc;
+   int i;
+   #define STBI__CASE(f) \
+       case f: \
+          for (i=0; i < n; ++i, raw += img_n, cur += out_n, prior += out_n)
+   switch (filter) {
+      STBI__CASE(STBI__F_sub)       { x = stbi__png_vload(raw); a = stbi__png_vor(stbi__png_vadd(x, a), alpha); stbi__png_vstore(cur, a); } break;
+      STBI__CASE(STBI__F_up)        { x = stbi__png_vload(raw); b = stbi__png_vload(prior); a = stbi__png_vor(stbi__png_vadd(x, b), alpha); stbi__png_vstore(cur, a); } break;
+      STBI__CASE(STBI__F_avg)       { x = stbi__png_vload(raw); b = stbi__png_vload(prior); a = stbi__png_vor(stbi__png_vadd(x, stbi__png_vavg(a, b)), alpha); stbi__png_vstore(cur, a); } break;
+      STBI__CASE(STBI__F_avg_first) { x = stbi__png_vload(raw); a = stbi__png_vor(stbi__png_vadd(x, stbi__png_vavg(a, stbi__png_vzero())), alpha); stbi__png_vstore(cur, a); } break;
+      STBI__CASE(STBI__F_paeth)     { x = stbi__png_vload(raw); b = stbi__png_vload(prior); a = stbi__png_vor(stbi__png_vadd(x, stbi__png_vpaeth(a, b, c)), alpha); stbi__png_vstore(cur, a); c = b; } break;
+   }
+   #undef STBI__CASE
+   *pa = a;
+   *pc = c;
+}
+
+// unfilter the 'count' 8-bit pixels following the first one of a row. raw
+// has img_n (3 or 4) bytes per pixel and cur gets out_n; prior is only read
+// by Up, Avg and Paeth, which never occur on the first row
+static void stbi__png_unfilter_row_simd(stbi_uc *cur, stbi_uc const *prior, stbi_uc const *raw, int filter, int count, int img_n, int out_n)
+{
+   stbi_uc lr[4], lp[4], lc[4];
+   stbi__png_vec a, c, alpha = out_n != img_n ? stbi__png_valpha() : stbi__png_vzero();
+   int use_prior = (filter == STBI__F_up || filter == STBI__F_avg || filter == STBI__F_paeth);
+
+   if (filter == STBI__F_paeth_first) filter = STBI__F_sub; // Paeth(a,0,0) == a
+
+   memcpy(lc, cur - out_n, out_n);
+   a = stbi__png_vload(lc);
+   c = stbi__png_vzero();
+   if (use_prior) {
+      memcpy(lp, prior - out_n, out_n);
+      c = stbi__png_vload(lp);
+   }
+   stbi__png_unfilter_simd_run(cur, prior, raw, filter, count-1, img_n, out_n, alpha, &a, &c);
+
+   raw += (count-1)*img_n;
+   cur += (count-1)*out_n;
+   prior += (count-1)*out_n;
+   memcpy(lr, raw, img_n);
+   if (use_prior) memcpy(lp, prior, out_n);
+   stbi__png_unfilter_simd_run(lc, lp, lr, filter, 1, img_n, out_n, alpha, &a, &c);
+   memcpy(cur, lc, out_n);
+}
+#endif
+
+// unfilter row j of the png data; raw points at its filter byte. rows are
+// written straight into a->out, which must hold x*y*out_n*bytes bytes, and
+// row j-1 must still be in its unfiltered form (see stbi__png_finish_row)
+static int stbi__png_unfilter_row(stbi__png *a, stbi_uc *raw, stbi__uint32 j, int out_n, stbi__uint32 x, int depth)
 {
    int bytes = (depth == 16? 2 : 1);
    stbi__context *s = a->s;
-   stbi__uint32 i,j,stride = x*out_n*bytes;
-   stbi__uint32 img_len, img_width_bytes;
+   stbi__uint32 i,stride = x*out_n*bytes;
+   stbi__uint32 img_width_bytes;
    int k;
    int img_n = s->img_n; // copy it into a local for later
 
@@ -4294,223 +5467,523 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
    int filter_bytes = img_n*bytes;
    int width = x;
 
-   STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
-   a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
-   if (!a->out) return stbi__err("outofmem", "Out of memory");
+   stbi_uc *cur = a->out + stride*j;
+   stbi_uc *prior;
+   int filter = *raw++;
 
+   STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
    img_width_bytes = (((img_n * x * depth) + 7) >> 3);
-   img_len = (img_width_bytes + 1) * y;
-   // we used to check for exact match between raw_len and img_len on non-interlaced PNGs,
-   // but issue #276 reported a PNG in the wild that had extra data at the end (all zeros),
-   // so just check for raw_len < img_len always.
-   if (raw_len < img_len) return stbi__err("not enough pixels","Corrupt PNG");
 
-   for (j=0; j < y; ++j) {
-      stbi_uc *cur = a->out + stride*j;
-      stbi_uc *prior;
-      int filter = *raw++;
+   if (filter > 4)
+      return stbi__err("invalid filter","Corrupt PNG");
+
+   if (depth < 8) {
+      STBI_ASSERT(img_width_bytes <= x);
+      cur += x*out_n - img_width_bytes; // store output to the rightmost img_len bytes, so we can decode in place
+      filter_bytes = 1;
+      width = img_width_bytes;
+   }
+   prior = cur - stride; // bugfix: need to compute this after 'cur +=' computation above
+
+   // if first row, use special filter that doesn't sample previous row
+   if (j == 0) filter = first_row_filter[filter];
+
+   // handle first byte explicitly
+   for (k=0; k < filter_bytes; ++k) {
+      switch (filter) {
+         case STBI__F_none       : cur[k] = raw[k]; break;
+         case STBI__F_sub        : cur[k] = raw[k]; break;
+         case STBI__F_up         : cur[k] = STBI__BYTECAST(raw[k] + prior[k]); break;
+         case STBI__F_avg        : cur[k] = STBI__BYTECAST(raw[k] + (prior[k]>>1)); break;
+         case STBI__F_paeth      : cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(0,prior[k],0)); break;
+         case STBI__F_avg_first  : cur[k] = raw[k]; break;
+         case STBI__F_paeth_first: cur[k] = raw[k]; break;
+      }
+   }
 
-      if (filter > 4)
-         return stbi__err("invalid filter","Corrupt PNG");
+   if (depth == 8) {
+      if (img_n != out_n)
+         cur[img_n] = 255; // first pixel
+      raw += img_n;
+      cur += out_n;
+      prior += out_n;
+   } else if (depth == 16) {
+      if (img_n != out_n) {
+         cur[filter_bytes]   = 255; // first pixel top byte
+         cur[filter_bytes+1] = 255; // first pixel bottom byte
+      }
+      raw += filter_bytes;
+      cur += output_bytes;
+      prior += output_bytes;
+   } else {
+      raw += 1;
+      cur += 1;
+      prior += 1;
+   }
+
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+   if (a->simd && depth == 8 && img_n >= 3 && width > 1 && filter != STBI__F_none && (filter != STBI__F_up || img_n != out_n)) {
+      stbi__png_unfilter_row_simd(cur, prior, raw, filter, width-1, img_n, out_n);
+      return 1;
+   }
+#endif
 
-      if (depth < 8) {
-         STBI_ASSERT(img_width_bytes <= x);
-         cur += x*out_n - img_width_bytes; // store output to the rightmost img_len bytes, so we can decode in place
-         filter_bytes = 1;
-         width = img_width_bytes;
+   // this is a little gross, so that we don't switch per-pixel or per-component
+   if (depth < 8 || img_n == out_n) {
+      int nk = (width - 1)*filter_bytes;
+      #define STBI__CASE(f) \
+          case f:     \
+             for (k=0; k < nk; ++k)
+      switch (filter) {
+         // "none" filter turns into a memcpy here; make that explicit.
+         case STBI__F_none:         memcpy(cur, raw, nk); break;
+         STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]); } break;
+         STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
+         STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-filter_bytes])>>1)); } break;
+         STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],prior[k],prior[k-filter_bytes])); } break;
+         STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k-filter_bytes] >> 1)); } break;
+         STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],0,0)); } break;
       }
-      prior = cur - stride; // bugfix: need to compute this after 'cur +=' computation above
-
-      // if first row, use special filter that doesn't sample previous row
-      if (j == 0) filter = first_row_filter[filter];
-
-      // handle first byte explicitly
-      for (k=0; k < filter_bytes; ++k) {
-         switch (filter) {
-            case STBI__F_none       : cur[k] = raw[k]; break;
-            case STBI__F_sub        : cur[k] = raw[k]; break;
-            case STBI__F_up         : cur[k] = STBI__BYTECAST(raw[k] + prior[k]); break;
-            case STBI__F_avg        : cur[k] = STBI__BYTECAST(raw[k] + (prior[k]>>1)); break;
-            case STBI__F_paeth      : cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(0,prior[k],0)); break;
-            case STBI__F_avg_first  : cur[k] = raw[k]; break;
-            case STBI__F_paeth_first: cur[k] = raw[k]; break;
-         }
+      #undef STBI__CASE
+   } else {
+      STBI_ASSERT(img_n+1 == out_n);
+      #define STBI__CASE(f) \
+          case f:     \
+             for (i=x-1; i >= 1; --i, cur[filter_bytes]=255,raw+=filter_bytes,cur+=output_bytes,prior+=output_bytes) \
+                for (k=0; k < filter_bytes; ++k)
+      switch (filter) {
+         STBI__CASE(STBI__F_none)         { cur[k] = raw[k]; } break;
+         STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k- output_bytes]); } break;
+         STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
+         STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k- output_bytes])>>1)); } break;
+         STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],prior[k],prior[k- output_bytes])); } break;
+         STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k- output_bytes] >> 1)); } break;
+         STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],0,0)); } break;
       }
+      #undef STBI__CASE
 
-      if (depth == 8) {
-         if (img_n != out_n)
-            cur[img_n] = 255; // first pixel
-         raw += img_n;
-         cur += out_n;
-         prior += out_n;
-      } else if (depth == 16) {
-         if (img_n != out_n) {
-            cur[filter_bytes]   = 255; // first pixel top byte
-            cur[filter_bytes+1] = 255; // first pixel bottom byte
+      // the loop above sets the high byte of the pixels' alpha, but for
+      // 16 bit png files we also need the low byte set. we'll do that here.
+      if (depth == 16) {
+         cur = a->out + stride*j; // start at the beginning of the row again
+         for (i=0; i < x; ++i,cur+=output_bytes) {
+            cur[filter_bytes+1] = 255;
          }
-         raw += filter_bytes;
-         cur += output_bytes;
-         prior += output_bytes;
-      } else {
-         raw += 1;
-         cur += 1;
-         prior += 1;
       }
+   }
+   return 1;
+}
+
+// expand bits to pixels, or byte-swap 16-bit samples, in row j. this can
+// only run once row j+1 is unfiltered, since that reads row j as it was
+// stored in the file; running it one row behind keeps it in the cache.
+static void stbi__png_finish_row(stbi__png *a, stbi__uint32 j, int out_n, stbi__uint32 x, int depth, int color)
+{
+   int bytes = (depth == 16? 2 : 1);
+   stbi__uint32 i,stride = x*out_n*bytes;
+   stbi__uint32 img_width_bytes;
+   int k;
+   int img_n = a->s->img_n;
+
+   img_width_bytes = (((img_n * x * depth) + 7) >> 3);
 
-      // this is a little gross, so that we don't switch per-pixel or per-component
-      if (depth < 8 || img_n == out_n) {
-         int nk = (width - 1)*filter_bytes;
-         #define STBI__CASE(f) \
-             case f:     \
-                for (k=0; k < nk; ++k)
-         switch (filter) {
-            // "none" filter turns into a memcpy here; make that explicit.
-            case STBI__F_none:         memcpy(cur, raw, nk); break;
-            STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]); } break;
-            STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
-            STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-filter_bytes])>>1)); } break;
-            STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],prior[k],prior[k-filter_bytes])); } break;
-            STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k-filter_bytes] >> 1)); } break;
-            STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],0,0)); } break;
+   if (depth < 8) {
+      stbi_uc *cur = a->out + stride*j;
+      stbi_uc *in  = a->out + stride*j + x*out_n - img_width_bytes;
+      // unpack 1/2/4-bit into a 8-bit buffer. allows us to keep the common 8-bit path optimal at minimal cost for 1/2/4-bit
+      // png guarante byte alignment, if width is not multiple of 8/4/2 we'll decode dummy trailing data that will be skipped in the later loop
+      stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
+
+      // note that the final byte might overshoot and write more data than desired.
+      // we can allocate enough data that this never writes out of memory, but it
+      // could also overwrite the next scanline. can it overwrite non-empty data
+      // on the next scanline? yes, consider 1-pixel-wide scanlines with 1-bit-per-pixel.
+      // so we need to explicitly clamp the final ones
+
+      if (depth == 4) {
+         for (k=x*img_n; k >= 2; k-=2, ++in) {
+            *cur++ = scale * ((*in >> 4)       );
+            *cur++ = scale * ((*in     ) & 0x0f);
          }
-         #undef STBI__CASE
-         raw += nk;
-      } else {
-         STBI_ASSERT(img_n+1 == out_n);
-         #define STBI__CASE(f) \
-             case f:     \
-                for (i=x-1; i >= 1; --i, cur[filter_bytes]=255,raw+=filter_bytes,cur+=output_bytes,prior+=output_bytes) \
-                   for (k=0; k < filter_bytes; ++k)
-         switch (filter) {
-            STBI__CASE(STBI__F_none)         { cur[k] = raw[k]; } break;
-            STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k- output_bytes]); } break;
-            STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
-            STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k- output_bytes])>>1)); } break;
-            STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],prior[k],prior[k- output_bytes])); } break;
-            STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k- output_bytes] >> 1)); } break;
-            STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],0,0)); } break;
+         if (k > 0) *cur++ = scale * ((*in >> 4)       );
+      } else if (depth == 2) {
+         for (k=x*img_n; k >= 4; k-=4, ++in) {
+            *cur++ = scale * ((*in >> 6)       );
+            *cur++ = scale * ((*in >> 4) & 0x03);
+            *cur++ = scale * ((*in >> 2) & 0x03);
+            *cur++ = scale * ((*in     ) & 0x03);
          }
-         #undef STBI__CASE
-
-         // the loop above sets the high byte of the pixels' alpha, but for
-         // 16 bit png files we also need the low byte set. we'll do that here.
-         if (depth == 16) {
-            cur = a->out + stride*j; // start at the beginning of the row again
-            for (i=0; i < x; ++i,cur+=output_bytes) {
-               cur[filter_bytes+1] = 255;
-            }
+         if (k > 0) *cur++ = scale * ((*in >> 6)       );
+         if (k > 1) *cur++ = scale * ((*in >> 4) & 0x03);
+         if (k > 2) *cur++ = scale * ((*in >> 2) & 0x03);
+      } else if (depth == 1) {
+         for (k=x*img_n; k >= 8; k-=8, ++in) {
+            *cur++ = scale * ((*in >> 7)       );
+            *cur++ = scale * ((*in >> 6) & 0x01);
+            *cur++ = scale * ((*in >> 5) & 0x01);
+            *cur++ = scale * ((*in >> 4) & 0x01);
+            *cur++ = scale * ((*in >> 3) & 0x01);
+            *cur++ = scale * ((*in >> 2) & 0x01);
+            *cur++ = scale * ((*in >> 1) & 0x01);
+            *cur++ = scale * ((*in     ) & 0x01);
          }
+         if (k > 0) *cur++ = scale * ((*in >> 7)       );
+         if (k > 1) *cur++ = scale * ((*in >> 6) & 0x01);
+         if (k > 2) *cur++ = scale * ((*in >> 5) & 0x01);
+         if (k > 3) *cur++ = scale * ((*in >> 4) & 0x01);
+         if (k > 4) *cur++ = scale * ((*in >> 3) & 0x01);
+         if (k > 5) *cur++ = scale * ((*in >> 2) & 0x01);
+         if (k > 6) *cur++ = scale * ((*in >> 1) & 0x01);
       }
-   }
-
-   // we make a separate pass to expand bits to pixels; for performance,
-   // this could run two scanlines behind the above code, so it won't
-   // intefere with filtering but will still be in the cache.
-   if (depth < 8) {
-      for (j=0; j < y; ++j) {
-         stbi_uc *cur = a->out + stride*j;
-         stbi_uc *in  = a->out + stride*j + x*out_n - img_width_bytes;
-         // unpack 1/2/4-bit into a 8-bit buffer. allows us to keep the common 8-bit path optimal at minimal cost for 1/2/4-bit
-         // png guarante byte alignment, if width is not multiple of 8/4/2 we'll decode dummy trailing data that will be skipped in the later loop
-         stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
-
-         // note that the final byte might overshoot and write more data than desired.
-         // we can allocate enough data that this never writes out of memory, but it
-         // could also overwrite the next scanline. can it overwrite non-empty data
-         // on the next scanline? yes, consider 1-pixel-wide scanlines with 1-bit-per-pixel.
-         // so we need to explicitly clamp the final ones
-
-         if (depth == 4) {
-            for (k=x*img_n; k >= 2; k-=2, ++in) {
-               *cur++ = scale * ((*in >> 4)       );
-               *cur++ = scale * ((*in     ) & 0x0f);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 4)       );
-         } else if (depth == 2) {
-            for (k=x*img_n; k >= 4; k-=4, ++in) {
-               *cur++ = scale * ((*in >> 6)       );
-               *cur++ = scale * ((*in >> 4) & 0x03);
-               *cur++ = scale * ((*in >> 2) & 0x03);
-               *cur++ = scale * ((*in     ) & 0x03);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 6)       );
-            if (k > 1) *cur++ = scale * ((*in >> 4) & 0x03);
-            if (k > 2) *cur++ = scale * ((*in >> 2) & 0x03);
-         } else if (depth == 1) {
-            for (k=x*img_n; k >= 8; k-=8, ++in) {
-               *cur++ = scale * ((*in >> 7)       );
-               *cur++ = scale * ((*in >> 6) & 0x01);
-               *cur++ = scale * ((*in >> 5) & 0x01);
-               *cur++ = scale * ((*in >> 4) & 0x01);
-               *cur++ = scale * ((*in >> 3) & 0x01);
-               *cur++ = scale * ((*in >> 2) & 0x01);
-               *cur++ = scale * ((*in >> 1) & 0x01);
-               *cur++ = scale * ((*in     ) & 0x01);
+      if (img_n != out_n) {
+         int q;
+         // insert alpha = 255
+         cur = a->out + stride*j;
+         if (img_n == 1) {
+            for (q=x-1; q >= 0; --q) {
+               cur[q*2+1] = 255;
+               cur[q*2+0] = cur[q];
             }
-            if (k > 0) *cur++ = scale * ((*in >> 7)       );
-            if (k > 1) *cur++ = scale * ((*in >> 6) & 0x01);
-            if (k > 2) *cur++ = scale * ((*in >> 5) & 0x01);
-            if (k > 3) *cur++ = scale * ((*in >> 4) & 0x01);
-            if (k > 4) *cur++ = scale * ((*in >> 3) & 0x01);
-            if (k > 5) *cur++ = scale * ((*in >> 2) & 0x01);
-            if (k > 6) *cur++ = scale * ((*in >> 1) & 0x01);
-         }
-         if (img_n != out_n) {
-            int q;
-            // insert alpha = 255
-            cur = a->out + stride*j;
-            if (img_n == 1) {
-               for (q=x-1; q >= 0; --q) {
-                  cur[q*2+1] = 255;
-                  cur[q*2+0] = cur[q];
-               }
-            } else {
-               STBI_ASSERT(img_n == 3);
-               for (q=x-1; q >= 0; --q) {
-                  cur[q*4+3] = 255;
-                  cur[q*4+2] = cur[q*3+2];
-                  cur[q*4+1] = cur[q*3+1];
-                  cur[q*4+0] = cur[q*3+0];
-               }
+         } else {
+            STBI_ASSERT(img_n == 3);
+            for (q=x-1; q >= 0; --q) {
+               cur[q*4+3] = 255;
+               cur[q*4+2] = cur[q*3+2];
+               cur[q*4+1] = cur[q*3+1];
+               cur[q*4+0] = cur[q*3+0];
             }
          }
       }
    } else if (depth == 16) {
       // force the image data from big-endian to platform-native.
-      // this is done in a separate pass due to the decoding relying
-      // on the data being untouched, but could probably be done
-      // per-line during decode if care is taken.
-      stbi_uc *cur = a->out;
+      stbi_uc *cur = a->out + stride*j;
       stbi__uint16 *cur16 = (stbi__uint16*)cur;
 
-      for(i=0; i < x*y*out_n; ++i,cur16++,cur+=2) {
+      for(i=0; i < x*out_n; ++i,cur16++,cur+=2) {
          *cur16 = (cur[0] << 8) | cur[1];
       }
    }
+}
+
+// create the png data from post-deflated data
+static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+{
+   int bytes = (depth == 16? 2 : 1);
+   stbi__uint32 j, img_len, img_width_bytes;
+
+   a->out = (stbi_uc *) stbi__malloc_mad3(x, y, out_n*bytes, 0); // extra bytes to write off the end into
+   if (!a->out) return stbi__err("outofmem", "Out of memory");
+
+   img_width_bytes = (((a->s->img_n * x * depth) + 7) >> 3);
+   img_len = (img_width_bytes + 1) * y;
+   // we used to check for exact match between raw_len and img_len on non-interlaced PNGs,
+   // but issue #276 reported a PNG in the wild that had extra data at the end (all zeros),
+   // so just check for raw_len < img_len always.
+   if (raw_len < img_len) return stbi__err("not enough pixels","Corrupt PNG");
+
+   for (j=0; j < y; ++j) {
+      if (!stbi__png_unfilter_row(a, raw, j, out_n, x, depth)) return 0;
+      if (j > 0) stbi__png_finish_row(a, j-1, out_n, x, depth, color);
+      raw += img_width_bytes + 1;
+   }
+   stbi__png_finish_row(a, y-1, out_n, x, depth, color);
+
+   return 1;
+}
+
+typedef struct
+{
+   stbi__png *a;
+   stbi__uint32 x, y, j; // size, and the next row to unfilter
+   int out_n, depth, color;
+   int shift;            // keep only every (1<<shift)th pixel of every (1<<shift)th row
+   stbi_uc *rows;        // with shift: two full-width rows to unfilter into
+   stbi_uc *final;       // with shift: the reduced image
+} stbi__png_rows;
+
+// copy the kept pixels of finished row j, held in the first slot of r->rows
+static void stbi__png_keep_row(stbi__png_rows *r, stbi__uint32 j)
+{
+   int out_bytes = r->out_n * (r->depth == 16 ? 2 : 1);
+   stbi__uint32 i, final_x = (r->x + (1 << r->shift) - 1) >> r->shift;
+   stbi_uc *out;
+   if (j & ((1 << r->shift) - 1)) return;
+   out = r->final + (j >> r->shift) * final_x * out_bytes;
+   for (i=0; i < final_x; ++i)
+      memcpy(out + i*out_bytes, r->rows + (i << r->shift)*out_bytes, out_bytes);
+}
+
+// reduced decode: unfiltering needs the whole previous row, so rows go
+// through a two-row buffer, row j-1 in the first slot as the prior of row j
+// in the second. once row j is unfiltered, row j-1 is finished, sampled, and
+// replaced by row j.
+static int stbi__png_consume_row_reduced(stbi__png_rows *r, stbi_uc *raw)
+{
+   stbi__png *a = r->a;
+   stbi__uint32 stride = r->x * r->out_n * (r->depth == 16 ? 2 : 1);
+   a->out = r->rows;
+   if (r->j == 0) {
+      if (!stbi__png_unfilter_row(a, raw, 0, r->out_n, r->x, r->depth)) return 0;
+   } else {
+      if (!stbi__png_unfilter_row(a, raw, 1, r->out_n, r->x, r->depth)) return 0;
+      stbi__png_finish_row(a, 0, r->out_n, r->x, r->depth, r->color);
+      stbi__png_keep_row(r, r->j-1);
+      memcpy(r->rows, r->rows + stride, stride);
+   }
+   ++r->j;
+   return 1;
+}
+
+static int stbi__png_consume_row(void *user, stbi_uc *raw)
+{
+   stbi__png_rows *r = (stbi__png_rows *) user;
+   if (r->j >= r->y) return 1; // trailing data after the last row, see issue #276 above
+   if (r->shift) return stbi__png_consume_row_reduced(r, raw);
+   if (!stbi__png_unfilter_row(r->a, raw, r->j, r->out_n, r->x, r->depth)) return 0;
+   if (r->j > 0) stbi__png_finish_row(r->a, r->j-1, r->out_n, r->x, r->depth, r->color);
+   ++r->j;
+   return 1;
+}
+
+#ifdef STBI__THREADS
+// two-stage decode: a second thread inflates into a ring of rows while the
+// calling thread unfilters them. rows change hands in batches, so the lock
+// is taken a few times per ring rather than once per row
+typedef struct
+{
+   stbi__zbuf *z;
+   char *obuf;
+   int olen, parse_header;
+   stbi_uc *ring;
+   int row_len, nslot, batch;
+   int filled;          // rows inflated; only the inflater touches this
+   int head, tail;      // rows handed to the unfilter, rows it has released
+   int done, abort, ok;
+   const char *failure; // the inflater's error, if any
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+} stbi__png_pipe;
+
+// hand the rows inflated so far over, then wait for room for another batch
+static int stbi__png_pipe_publish(stbi__png_pipe *p)
+{
+   int ok;
+   pthread_mutex_lock(&p->lock);
+   p->head = p->filled;
+   pthread_cond_signal(&p->cond);
+   while (!p->abort && p->filled - p->tail > p->nslot - p->batch)
+      pthread_cond_wait(&p->cond, &p->lock);
+   ok = !p->abort;
+   pthread_mutex_unlock(&p->lock);
+   return ok;
+}
+
+static int stbi__png_pipe_put(void *user, stbi_uc *row)
+{
+   stbi__png_pipe *p = (stbi__png_pipe *) user;
+   memcpy(p->ring + (p->filled % p->nslot) * p->row_len, row, p->row_len);
+   ++p->filled;
+   if (p->filled - p->head >= p->batch) return stbi__png_pipe_publish(p);
+   return 1;
+}
+
+static void *stbi__png_pipe_inflate(void *arg)
+{
+   stbi__png_pipe *p = (stbi__png_pipe *) arg;
+   int ok = stbi__do_zlib_rows(p->z, p->obuf, p->olen, p->parse_header);
+   pthread_mutex_lock(&p->lock);
+   p->head = p->filled;
+   p->done = 1;
+   p->ok = ok;
+   if (!ok) p->failure = stbi_failure_reason();
+   pthread_cond_signal(&p->cond);
+   pthread_mutex_unlock(&p->lock);
+   return NULL;
+}
+
+// returns -1 without doing anything if the pipeline can't be set up, so the
+// caller decodes serially
+static int stbi__png_pipe_run(stbi__zbuf *z, stbi__png_rows *r, char *obuf, int olen, int parse_header)
+{
+   stbi__png_pipe p;
+   pthread_t thread;
+   int ok = 1;
+
+   p.row_len = z->z_row_len;
+   p.batch = (256 << 10) / p.row_len;
+   if (p.batch < 4) p.batch = 4;
+   p.nslot = 4 * p.batch;
+   p.ring = (stbi_uc *) stbi__malloc_mad2(p.nslot, p.row_len, 0);
+   if (p.ring == NULL) return -1;
+   p.z = z;
+   p.obuf = obuf;
+   p.olen = olen;
+   p.parse_header = parse_header;
+   p.filled = p.head = p.tail = 0;
+   p.done = p.abort = 0;
+   p.ok = 0;
+   p.failure = NULL;
+   z->z_row = stbi__png_pipe_put;
+   z->z_row_user = &p;
+   pthread_mutex_init(&p.lock, NULL);
+   pthread_cond_init(&p.cond, NULL);
+   if (pthread_create(&thread, NULL, stbi__png_pipe_inflate, &p) != 0) {
+      z->z_row = stbi__png_consume_row;
+      z->z_row_user = r;
+      pthread_cond_destroy(&p.cond);
+      pthread_mutex_destroy(&p.lock);
+      STBI_FREE(p.ring);
+      return -1;
+   }
 
+   for (;;) {
+      int k, avail, done;
+      pthread_mutex_lock(&p.lock);
+      while (p.tail == p.head && !p.done)
+         pthread_cond_wait(&p.cond, &p.lock);
+      avail = p.head;
+      done = p.done;
+      pthread_mutex_unlock(&p.lock);
+      if (p.tail == avail && done) break;
+      for (k=p.tail; ok && k < avail; ++k)
+         ok = stbi__png_consume_row(r, p.ring + (k % p.nslot) * p.row_len);
+      pthread_mutex_lock(&p.lock);
+      p.tail = avail;
+      p.abort = !ok;
+      pthread_cond_signal(&p.cond);
+      pthread_mutex_unlock(&p.lock);
+      if (!ok) break;
+   }
+   pthread_join(thread, NULL);
+   pthread_cond_destroy(&p.cond);
+   pthread_mutex_destroy(&p.lock);
+   STBI_FREE(p.ring);
+   if (ok && !p.ok) {
+      stbi__g_failure_reason = p.failure;
+      ok = 0;
+   }
+   return ok;
+}
+#endif // STBI__THREADS
+
+// inflate and unfilter a non-interlaced image together: the inflater runs in
+// a window of 32k history plus a couple of rows, handing each row to the
+// unfilter as soon as it is complete, so the inflated image never exists
+// in full. with 'shift' > 0, the image is also reduced by 1<<shift on the
+// way, see stbi__png_consume_row_reduced, so neither is the full-size output.
+static int stbi__png_stream_image(stbi__png *a, stbi__uint32 idata_len, int out_n, int depth, int color, int parse_header, int shift)
+{
+   int bytes = (depth == 16? 2 : 1);
+   stbi__uint32 x = a->s->img_x, y = a->s->img_y;
+   stbi__uint32 final_x = (x + (1 << shift) - 1) >> shift;
+   stbi__uint32 final_y = (y + (1 << shift) - 1) >> shift;
+   int row_len = (int) ((((a->s->img_n * x * depth) + 7) >> 3) + 1);
+   int window = 65536 + 2*row_len;
+   stbi__png_rows r;
+   stbi__zbuf z;
+   int ok;
+
+   r.rows = r.final = NULL;
+   if (shift) {
+      r.final = (stbi_uc *) stbi__malloc_mad3(final_x, final_y, out_n*bytes, 0);
+      if (!r.final) return stbi__err("outofmem", "Out of memory");
+      a->out = r.rows = (stbi_uc *) stbi__malloc_mad3(x, 2, out_n*bytes, 0);
+   } else {
+      a->out = (stbi_uc *) stbi__malloc_mad3(x, y, out_n*bytes, 0);
+   }
+   if (!a->out) { STBI_FREE(r.final); return stbi__err("outofmem", "Out of memory"); }
+   a->expanded = (stbi_uc *) stbi__malloc(window);
+   if (!a->expanded) { STBI_FREE(r.final); return stbi__err("outofmem", "Out of memory"); }
+
+   r.a = a;
+   r.x = x;
+   r.y = y;
+   r.j = 0;
+   r.out_n = out_n;
+   r.depth = depth;
+   r.color = color;
+   r.shift = shift;
+   z.zbuffer = a->idata;
+   z.zbuffer_end = a->idata + idata_len;
+   z.z_row = stbi__png_consume_row;
+   z.z_row_len = row_len;
+   z.z_row_user = &r;
+   ok = -1;
+   #ifdef STBI__THREADS
+   // worth a thread only when there's a megabyte or so to inflate
+   if ((stbi__uint64) row_len * y >= (1 << 20) && stbi__thread_count() > 1)
+      ok = stbi__png_pipe_run(&z, &r, (char *) a->expanded, window, parse_header);
+   #endif
+   if (ok < 0)
+      ok = stbi__do_zlib_rows(&z, (char *) a->expanded, window, parse_header);
+   a->expanded = (stbi_uc *) z.zout_start; // may have been reallocated
+   if (ok && r.j < y) ok = stbi__err("not enough pixels","Corrupt PNG");
+   if (!ok) {
+      STBI_FREE(r.final); // a->out is freed by the caller
+      return 0;
+   }
+   if (shift) {
+      // the last row is still in the first slot
+      stbi__png_finish_row(a, 0, out_n, x, depth, color);
+      stbi__png_keep_row(&r, y-1);
+      STBI_FREE(r.rows);
+      a->out = r.final;
+      a->s->img_x = final_x;
+      a->s->img_y = final_y;
+   } else {
+      stbi__png_finish_row(a, y-1, out_n, x, depth, color);
+   }
    return 1;
 }
 
-static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint32 image_data_len, int out_n, int depth, int color, int interlaced)
+static int stbi__adam7_xorig[] = { 0,4,0,2,0,1,0 };
+static int stbi__adam7_yorig[] = { 0,0,4,0,2,0,1 };
+static int stbi__adam7_xspc[]  = { 8,8,4,4,2,2,1 };
+static int stbi__adam7_yspc[]  = { 8,8,8,4,4,2,2 };
+
+// pass 1 alone has a pixel every 8x8, passes 1-3 every 4x4, passes 1-5
+// every 2x2; so a decode reduced by 1<<shift only needs the first few
+static int stbi__adam7_passes(int shift)
+{
+   return 7 - 2*shift;
+}
+
+// size of the filtered data of the first 'passes' adam7 passes
+static stbi__uint32 stbi__adam7_len(stbi__context *s, int depth, int passes)
+{
+   stbi__uint32 len = 0;
+   int p;
+   for (p=0; p < passes; ++p) {
+      stbi__uint32 x = (s->img_x - stbi__adam7_xorig[p] + stbi__adam7_xspc[p]-1) / stbi__adam7_xspc[p];
+      stbi__uint32 y = (s->img_y - stbi__adam7_yorig[p] + stbi__adam7_yspc[p]-1) / stbi__adam7_yspc[p];
+      if (x && y)
+         len += ((((s->img_n * x * depth) + 7) >> 3) + 1) * y;
+   }
+   return len;
+}
+
+// for interlaced images, 'shift' > 0 builds an image reduced by 1<<shift
+// from just the adam7 passes that land on its pixels; see stbi__adam7_passes
+static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint32 image_data_len, int out_n, int depth, int color, int interlaced, int shift)
 {
    int bytes = (depth == 16 ? 2 : 1);
    int out_bytes = out_n * bytes;
+   int r = (1 << shift) - 1;
+   stbi__uint32 final_x = (a->s->img_x + r) >> shift;
+   stbi__uint32 final_y = (a->s->img_y + r) >> shift;
+   int passes = stbi__adam7_passes(shift);
    stbi_uc *final;
    int p;
    if (!interlaced)
       return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color);
 
    // de-interlacing
-   final = (stbi_uc *) stbi__malloc_mad3(a->s->img_x, a->s->img_y, out_bytes, 0);
-   for (p=0; p < 7; ++p) {
-      int xorig[] = { 0,4,0,2,0,1,0 };
-      int yorig[] = { 0,0,4,0,2,0,1 };
-      int xspc[]  = { 8,8,4,4,2,2,1 };
-      int yspc[]  = { 8,8,8,4,4,2,2 };
+   final = (stbi_uc *) stbi__malloc_mad3(final_x, final_y, out_bytes, 0);
+   for (p=0; p < passes; ++p) {
       int i,j,x,y;
       // pass1_x[4] = 0, pass1_x[5] = 1, pass1_x[12] = 1
-      x = (a->s->img_x - xorig[p] + xspc[p]-1) / xspc[p];
-      y = (a->s->img_y - yorig[p] + yspc[p]-1) / yspc[p];
+      x = (a->s->img_x - stbi__adam7_xorig[p] + stbi__adam7_xspc[p]-1) / stbi__adam7_xspc[p];
+      y = (a->s->img_y - stbi__adam7_yorig[p] + stbi__adam7_yspc[p]-1) / stbi__adam7_yspc[p];
       if (x && y) {
          stbi__uint32 img_len = ((((a->s->img_n * x * depth) + 7) >> 3) + 1) * y;
          if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color)) {
@@ -4519,9 +5992,9 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
          }
          for (j=0; j < y; ++j) {
             for (i=0; i < x; ++i) {
-               int out_y = j*yspc[p]+yorig[p];
-               int out_x = i*xspc[p]+xorig[p];
-               memcpy(final + out_y*a->s->img_x*out_bytes + out_x*out_bytes,
+               int out_y = (j*stbi__adam7_yspc[p]+stbi__adam7_yorig[p]) >> shift;
+               int out_x = (i*stbi__adam7_xspc[p]+stbi__adam7_xorig[p]) >> shift;
+               memcpy(final + out_y*final_x*out_bytes + out_x*out_bytes,
                       a->out + (j*x+i)*out_bytes, out_bytes);
             }
          }
@@ -4531,6 +6004,8 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
       }
    }
    a->out = final;
+   a->s->img_x = final_x;
+   a->s->img_y = final_y;
 
    return 1;
 }
@@ -4622,19 +6097,46 @@ static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int
    return 1;
 }
 
-static int stbi__unpremultiply_on_load = 0;
-static int stbi__de_iphone_flag = 0;
+static int stbi__unpremultiply_on_load_global = 0;
+static int stbi__de_iphone_flag_global = 0;
 
 STBIDEF void stbi_set_unpremultiply_on_load(int flag_true_if_should_unpremultiply)
 {
-   stbi__unpremultiply_on_load = flag_true_if_should_unpremultiply;
+   stbi__unpremultiply_on_load_global = flag_true_if_should_unpremultiply;
 }
 
 STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert)
 {
-   stbi__de_iphone_flag = flag_true_if_should_convert;
+   stbi__de_iphone_flag_global = flag_true_if_should_convert;
+}
+
+#ifndef STBI_THREAD_LOCAL
+#define stbi__unpremultiply_on_load  stbi__unpremultiply_on_load_global
+#define stbi__de_iphone_flag  stbi__de_iphone_flag_global
+#else
+static STBI_THREAD_LOCAL int stbi__unpremultiply_on_load_local, stbi__unpremultiply_on_load_set;
+static STBI_THREAD_LOCAL int stbi__de_iphone_flag_local, stbi__de_iphone_flag_set;
+
+STBIDEF void stbi_set_unpremultiply_on_load_thread(int flag_true_if_should_unpremultiply)
+{
+   stbi__unpremultiply_on_load_local = flag_true_if_should_unpremultiply;
+   stbi__unpremultiply_on_load_set = 1;
+}
+
+STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_convert)
+{
+   stbi__de_iphone_flag_local = flag_true_if_should_convert;
+   stbi__de_iphone_flag_set = 1;
 }
 
+#define stbi__unpremultiply_on_load  (stbi__unpremultiply_on_load_set           \
+                                       ? stbi__unpremultiply_on_load_local      \
+                                       : stbi__unpremultiply_on_load_global)
+#define stbi__de_iphone_flag  (stbi__de_iphone_flag_set                         \
+                                ? stbi__de_iphone_flag_local                    \
+                                : stbi__de_iphone_flag_global)
+#endif // STBI_THREAD_LOCAL
+
 static void stbi__de_iphone(stbi__png *z)
 {
    stbi__context *s = z->s;
@@ -4690,6 +6192,13 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
    stbi__context *s = z->s;
 
    z->expanded = NULL;
+#if defined(STBI_SSE2)
+   z->simd = stbi__sse2_available();
+#elif defined(STBI_NEON)
+   z->simd = 1;
+#else
+   z->simd = 0;
+#endif
    z->idata = NULL;
    z->out = NULL;
 
@@ -4792,20 +6301,40 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 
          case STBI__PNG_TYPE('I','E','N','D'): {
             stbi__uint32 raw_len, bpl;
+            int shift = stbi__reduce_on_load;
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (scan != STBI__SCAN_load) return 1;
             if (z->idata == NULL) return stbi__err("no IDAT","Corrupt PNG");
-            // initial guess for decoded data size to avoid unnecessary reallocs
-            bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
-            raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
-            z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
-            if (z->expanded == NULL) return 0; // zlib should set error
-            STBI_FREE(z->idata); z->idata = NULL;
             if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
                s->img_out_n = s->img_n+1;
             else
                s->img_out_n = s->img_n;
-            if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
+            if (!interlace) {
+               if (!stbi__png_stream_image(z, ioff, s->img_out_n, z->depth, color, !is_iphone, shift)) return 0;
+            } else {
+               if (shift) {
+                  // reduced interlaced decode: the passes we need come first in
+                  // the stream, so inflate only those and ignore the rest
+                  stbi__zbuf a;
+                  int len;
+                  raw_len = stbi__adam7_len(s, z->depth, stbi__adam7_passes(shift));
+                  z->expanded = (stbi_uc *) stbi__malloc(raw_len ? raw_len : 1);
+                  if (z->expanded == NULL) return stbi__err("outofmem", "Out of memory");
+                  a.zbuffer = z->idata;
+                  a.zbuffer_end = z->idata + ioff;
+                  len = stbi__do_zlib_prefix(&a, (char *) z->expanded, raw_len, !is_iphone);
+                  if (len < 0) return 0; // zlib should set error
+                  raw_len = len;
+               } else {
+                  // initial guess for decoded data size to avoid unnecessary reallocs
+                  bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
+                  raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
+                  z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
+                  if (z->expanded == NULL) return 0; // zlib should set error
+               }
+               if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace, shift)) return 0;
+            }
+            STBI_FREE(z->idata); z->idata = NULL;
             if (has_trans) {
                if (z->depth == 16) {
                   if (!stbi__compute_transparency16(z, tc16, s->img_out_n)) return 0;
@@ -4915,6 +6444,16 @@ static int stbi__png_info(stbi__context *s, int *x, int *y, int *comp)
    p.s = s;
    return stbi__png_info_raw(&p, x, y, comp);
 }
+
+static int stbi__png_is16(stbi__context *s)
+{
+   stbi__png p;
+   p.s = s;
+   if (!stbi__png_info_raw(&p, NULL, NULL, NULL))
+      return 0;
+   stbi__rewind(s);
+   return p.depth == 16;
+}
 #endif
 
 // Microsoft/Windows BMP image
@@ -6254,41 +7793,38 @@ static void stbi__fill_gif_background(stbi__gif *g, int x0, int y0, int x1, int
    }
 }
 
-// this function is designed to support animated gifs, although stb_image doesn't support it
+// decodes the next frame onto g->out, the canvas, which is kept from one frame
+// to the next. returns g->out, or s itself at the end of the stream.
 static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, int req_comp)
 {
    int i;
-   stbi_uc *prev_out = 0;
 
-   if (g->out == 0 && !stbi__gif_header(s, g, comp,0))
-      return 0; // stbi__g_failure_reason set by stbi__gif_header
-
-   if (!stbi__mad3sizes_valid(g->w, g->h, 4, 0))
-      return stbi__errpuc("too large", "GIF too large");
-
-   prev_out = g->out;
-   g->out = (stbi_uc *) stbi__malloc_mad3(4, g->w, g->h, 0);
-   if (g->out == 0) return stbi__errpuc("outofmem", "Out of memory");
-
-   switch ((g->eflags & 0x1C) >> 2) {
-      case 0: // unspecified (also always used on 1st frame)
-         stbi__fill_gif_background(g, 0, 0, 4 * g->w, 4 * g->w * g->h);
-         break;
-      case 1: // do not dispose
-         if (prev_out) memcpy(g->out, prev_out, 4 * g->w * g->h);
-         g->old_out = prev_out;
-         break;
-      case 2: // dispose to background
-         if (prev_out) memcpy(g->out, prev_out, 4 * g->w * g->h);
-         stbi__fill_gif_background(g, g->start_x, g->start_y, g->max_x, g->max_y);
-         break;
-      case 3: // dispose to previous
-         if (g->old_out) {
-            for (i = g->start_y; i < g->max_y; i += 4 * g->w)
-               memcpy(&g->out[i + g->start_x], &g->old_out[i + g->start_x], g->max_x - g->start_x);
-         }
-         break;
+   if (g->out == 0) {
+      if (!stbi__gif_header(s, g, comp,0))
+         return 0; // stbi__g_failure_reason set by stbi__gif_header
+      if (!stbi__mad3sizes_valid(g->w, g->h, 4, 0))
+         return stbi__errpuc("too large", "GIF too large");
+      g->out = (stbi_uc *) stbi__malloc_mad3(4, g->w, g->h, 0);
+      if (g->out == 0) return stbi__errpuc("outofmem", "Out of memory");
+      stbi__fill_gif_background(g, 0, 0, 4 * g->w, 4 * g->w * g->h);
+   } else {
+      // dispose of the previous frame; its flags and rectangle are still in g.
+      // unspecified (0) and do not dispose (1) leave it in place.
+      switch ((g->eflags & 0x1C) >> 2) {
+         case 2: // dispose to background
+            stbi__fill_gif_background(g, g->start_x, g->start_y, g->max_x, g->max_y);
+            break;
+         case 3: // dispose to previous
+            if (g->old_out) {
+               for (i = g->start_y; i < g->max_y; i += 4 * g->w)
+                  memcpy(&g->out[i + g->start_x], &g->old_out[i + g->start_x], g->max_x - g->start_x);
+            }
+            break;
+      }
    }
+   // a graphic control extension only applies to the frame that follows it
+   g->eflags = 0;
+   g->delay = 0;
 
    for (;;) {
       switch (stbi__get8(s)) {
@@ -6315,6 +7851,15 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
 
             g->lflags = stbi__get8(s);
 
+            // keep what this frame will draw over, to dispose it to previous
+            if (((g->eflags & 0x1C) >> 2) == 3) {
+               if (g->old_out == 0) {
+                  g->old_out = (stbi_uc *) stbi__malloc_mad3(4, g->w, g->h, 0);
+                  if (g->old_out == 0) return stbi__errpuc("outofmem", "Out of memory");
+               }
+               memcpy(g->old_out, g->out, 4 * g->w * g->h);
+            }
+
             if (g->lflags & 0x40) {
                g->step = 8 * g->line_size; // first interlaced spacing
                g->parse = 3;
@@ -6391,10 +7936,61 @@ static void *stbi__gif_load(stbi__context *s, int *x, int *y, int *comp, int req
    }
    else if (g->out)
       STBI_FREE(g->out);
+   if (g->old_out)
+      STBI_FREE(g->old_out);
    STBI_FREE(g);
    return u;
 }
 
+struct stbi_gif_anim
+{
+   stbi__context s;
+   stbi__gif g;
+};
+
+STBIDEF stbi_gif_anim *stbi_gif_anim_open_memory(stbi_uc const *buffer, int len, int *x, int *y)
+{
+   stbi_gif_anim *a = (stbi_gif_anim *) stbi__malloc(sizeof(*a));
+   if (a == 0) {
+      stbi__err("outofmem", "Out of memory");
+      return 0;
+   }
+   memset(a, 0, sizeof(*a));
+   stbi__start_mem(&a->s, buffer, len);
+   if (!stbi__gif_header(&a->s, &a->g, 0, 1)) {
+      STBI_FREE(a);
+      return 0;
+   }
+   if (x) *x = a->g.w;
+   if (y) *y = a->g.h;
+   stbi_gif_anim_rewind(a);
+   return a;
+}
+
+STBIDEF stbi_uc *stbi_gif_anim_next(stbi_gif_anim *a, int *delay_ms)
+{
+   stbi_uc *u = stbi__gif_load_next(&a->s, &a->g, 0, 4);
+   if (u == (stbi_uc *) &a->s) u = 0;  // end of animated gif marker
+   if (delay_ms) *delay_ms = a->g.delay * 10;
+   return u;
+}
+
+STBIDEF void stbi_gif_anim_rewind(stbi_gif_anim *a)
+{
+   if (a->g.out)     STBI_FREE(a->g.out);
+   if (a->g.old_out) STBI_FREE(a->g.old_out);
+   memset(&a->g, 0, sizeof(a->g));
+   stbi__rewind(&a->s);
+}
+
+STBIDEF void stbi_gif_anim_close(stbi_gif_anim *a)
+{
+   if (a == 0) return;
+   if (a->g.out)     STBI_FREE(a->g.out);
+   if (a->g.old_out) STBI_FREE(a->g.old_out);
+   STBI_FREE(a);
+}
+
 static int stbi__gif_info(stbi__context *s, int *x, int *y, int *comp)
 {
    return stbi__gif_info_raw(s,x,y,comp);
@@ -6661,7 +8257,7 @@ static int stbi__bmp_info(stbi__context *s, int *x, int *y, int *comp)
    if (p == NULL)
       return 0;
    if (x) *x = s->img_x;
-   if (y) *y = s->img_y;
+   if (y) *y = abs((int) s->img_y);
    if (comp) *comp = info.ma ? 4 : 3;
    return 1;
 }
@@ -6791,24 +8387,38 @@ static int      stbi__pnm_test(stbi__context *s)
 static void *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
    stbi_uc *out;
-   STBI_NOTUSED(ri);
+   int bytes;
 
-   if (!stbi__pnm_info(s, (int *)&s->img_x, (int *)&s->img_y, (int *)&s->img_n))
+   ri->bits_per_channel = stbi__pnm_info(s, (int *)&s->img_x, (int *)&s->img_y, (int *)&s->img_n);
+   if (ri->bits_per_channel == 0)
       return 0;
+   bytes = ri->bits_per_channel / 8;
 
    *x = s->img_x;
    *y = s->img_y;
    if (comp) *comp = s->img_n;
 
-   if (!stbi__mad3sizes_valid(s->img_n, s->img_x, s->img_y, 0))
+   if (!stbi__mad4sizes_valid(s->img_n, s->img_x, s->img_y, bytes, 0))
       return stbi__errpuc("too large", "PNM too large");
 
-   out = (stbi_uc *) stbi__malloc_mad3(s->img_n, s->img_x, s->img_y, 0);
+   out = (stbi_uc *) stbi__malloc_mad4(s->img_n, s->img_x, s->img_y, bytes, 0);
    if (!out) return stbi__errpuc("outofmem", "Out of memory");
-   stbi__getn(s, out, s->img_n * s->img_x * s->img_y);
+   stbi__getn(s, out, s->img_n * s->img_x * s->img_y * bytes);
+
+   if (bytes == 2) {
+      // samples are stored big-endian
+      stbi__uint16 *p = (stbi__uint16 *) out;
+      stbi_uc *b = out;
+      int i, n = s->img_n * s->img_x * s->img_y;
+      for (i=0; i < n; ++i, b += 2)
+         p[i] = (stbi__uint16) (b[0] << 8 | b[1]);
+   }
 
    if (req_comp && req_comp != s->img_n) {
-      out = stbi__convert_format(out, s->img_n, req_comp, s->img_x, s->img_y);
+      if (bytes == 2)
+         out = (stbi_uc *) stbi__convert_format16((stbi__uint16 *) out, s->img_n, req_comp, s->img_x, s->img_y);
+      else
+         out = stbi__convert_format(out, s->img_n, req_comp, s->img_x, s->img_y);
       if (out == NULL) return out; // stbi__convert_format frees input on failure
    }
    return out;
@@ -6850,6 +8460,7 @@ static int      stbi__pnm_getinteger(stbi__context *s, char *c)
    return value;
 }
 
+// returns the bits per channel, 8 or 16, or 0 if this is not a PNM
 static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp)
 {
    int maxv, dummy;
@@ -6882,50 +8493,239 @@ static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp)
 
    maxv = stbi__pnm_getinteger(s, &c);  // read max value
 
-   if (maxv > 255)
-      return stbi__err("max value > 255", "PPM image not 8-bit");
-   else
-      return 1;
+   if (maxv > 65535)
+      return stbi__err("max value > 65535", "PPM image not 8-bit or 16-bit");
+   return maxv > 255 ? 16 : 8;
+}
+
+static int stbi__pnm_is16(stbi__context *s)
+{
+   int r = stbi__pnm_info(s, NULL, NULL, NULL) == 16;
+   stbi__rewind(s);
+   return r;
+}
+#endif
+
+// *************************************************************************************************
+// QOI loader
+//
+// QOI: https://qoiformat.org/qoi-specification.pdf
+//
+// Each op gives the next pixel as a literal, an entry in a 64-slot hash of
+// recent pixels, a small difference from the previous pixel, or a run of it.
+
+#ifndef STBI_NO_QOI
+
+#define STBI__QOI_MAGIC  0x716f6966 // "qoif"
+
+// reads the 14-byte header; the colorspace byte is informational only
+static int stbi__qoi_header(stbi__context *s, int *x, int *y, int *comp)
+{
+   stbi__uint32 w, h;
+   int n;
+   if (stbi__get32be(s) != STBI__QOI_MAGIC) return 0;
+   w = stbi__get32be(s);
+   h = stbi__get32be(s);
+   n = stbi__get8(s);
+   stbi__get8(s);
+   if (stbi__at_eof(s) || w == 0 || h == 0 || w > 0x7fffffff || h > 0x7fffffff || (n != 3 && n != 4))
+      return 0;
+   *x = (int) w;
+   *y = (int) h;
+   *comp = n;
+   return 1;
+}
+
+static int stbi__qoi_test(stbi__context *s)
+{
+   int r = stbi__get32be(s) == STBI__QOI_MAGIC;
+   stbi__rewind(s);
+   return r;
+}
+
+static int stbi__qoi_info(stbi__context *s, int *x, int *y, int *comp)
+{
+   int w, h, n, r = stbi__qoi_header(s, &w, &h, &n);
+   stbi__rewind(s);
+   if (!r) return 0;
+   if (x) *x = w;
+   if (y) *y = h;
+   if (comp) *comp = n;
+   return 1;
+}
+
+// decodes the op stream in [p,end) into out. the ops are read straight from
+// memory; near the end they are copied into a zero-padded buffer instead, so
+// no op reads past 'end' and a truncated stream decodes on as zero bytes,
+// as it would with stbi__get8. with 'shift' > 0 every pixel still has to be
+// decoded, since each one depends on the ones before, but only every
+// (1<<shift)th pixel of every (1<<shift)th row is written out, as for
+// non-interlaced PNG.
+static void stbi__qoi_decode(stbi_uc *out, stbi_uc const *p, stbi_uc const *end, int w, int h, int n, int shift)
+{
+   stbi_uc index[64][4], px[4] = { 0, 0, 0, 255 }, tail[16];
+   int m = (1 << shift) - 1;
+   int i, j, run = 0;
+   memset(index, 0, sizeof(index));
+
+   for (j=0; j < h; ++j) {
+      int keep = !(j & m);
+      for (i=0; i < w; ++i) {
+         if (run) {
+            --run;
+         } else {
+            int b;
+            if (end - p < 5) {
+               size_t left = (size_t) (end - p);
+               memmove(tail, p, left);
+               memset(tail + left, 0, sizeof(tail) - left);
+               p = tail;
+               end = tail + sizeof(tail);
+            }
+            b = *p++;
+            if (b == 0xfe) {
+               px[0] = p[0];
+               px[1] = p[1];
+               px[2] = p[2];
+               p += 3;
+            } else if (b == 0xff) {
+               memcpy(px, p, 4);
+               p += 4;
+            } else switch (b >> 6) {
+               case 0: // index
+                  memcpy(px, index[b], 4);
+                  break;
+               case 1: // 2-bit differences, biased by 2
+                  px[0] = (stbi_uc) (px[0] + ((b >> 4) & 3) - 2);
+                  px[1] = (stbi_uc) (px[1] + ((b >> 2) & 3) - 2);
+                  px[2] = (stbi_uc) (px[2] + ( b       & 3) - 2);
+                  break;
+               case 2: { // "luma": green difference, red and blue relative to it
+                  int b2 = *p++, dg = (b & 63) - 32;
+                  px[0] = (stbi_uc) (px[0] + dg - 8 + (b2 >> 4));
+                  px[1] = (stbi_uc) (px[1] + dg);
+                  px[2] = (stbi_uc) (px[2] + dg - 8 + (b2 & 15));
+                  break;
+               }
+               default: // run of 1..62, this pixel included
+                  run = b & 63;
+                  break;
+            }
+            memcpy(index[(px[0]*3 + px[1]*5 + px[2]*7 + px[3]*11) & 63], px, 4);
+         }
+         if (keep && !(i & m)) {
+            out[0] = px[0];
+            out[1] = px[1];
+            out[2] = px[2];
+            if (n == 4) out[3] = px[3];
+            out += n;
+         }
+      }
+   }
+}
+
+static void *stbi__qoi_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
+{
+   stbi_uc *out, *data = NULL;
+   stbi_uc const *p, *end;
+   int shift = stbi__reduce_on_load, m = (1 << shift) - 1;
+   int w, h, n, ow, oh;
+   STBI_NOTUSED(ri);
+
+   if (!stbi__qoi_header(s, &w, &h, &n))
+      return stbi__errpuc("bad QOI header", "Corrupt QOI");
+   ow = (w + m) >> shift;
+   oh = (h + m) >> shift;
+   if (!stbi__mad3sizes_valid(ow, oh, n, 0))
+      return stbi__errpuc("too large", "QOI too large");
+
+   p = s->img_buffer;
+   end = s->img_buffer_end;
+   if (s->read_from_callbacks) {
+      // the rest of a file or callback stream is read into memory first. no
+      // valid stream is longer than 5 bytes a pixel plus the end marker
+      size_t len = (size_t) (end - p), cap = 1 << 16;
+      size_t most = (size_t) w * h * 5 + 8;
+      data = (stbi_uc *) stbi__malloc(cap);
+      if (!data) return stbi__errpuc("outofmem", "Out of memory");
+      memcpy(data, p, len);
+      for (;;) {
+         int got;
+         if (len == cap) {
+            stbi_uc *bigger;
+            if (cap >= most) break;
+            bigger = (stbi_uc *) STBI_REALLOC_SIZED(data, cap, cap * 2);
+            if (!bigger) { STBI_FREE(data); return stbi__errpuc("outofmem", "Out of memory"); }
+            data = bigger;
+            cap *= 2;
+         }
+         got = (s->io.read)(s->io_user_data, (char *) data + len, (int) (cap - len < INT_MAX ? cap - len : INT_MAX));
+         if (got <= 0) break;
+         len += got;
+      }
+      p = data;
+      end = data + len;
+   }
+
+   out = (stbi_uc *) stbi__malloc_mad3(ow, oh, n, 0);
+   if (out) stbi__qoi_decode(out, p, end, w, h, n, shift);
+   STBI_FREE(data);
+   if (!out) return stbi__errpuc("outofmem", "Out of memory");
+
+   *x = ow;
+   *y = oh;
+   if (comp) *comp = n;
+   if (req_comp && req_comp != n) {
+      out = stbi__convert_format(out, n, req_comp, ow, oh);
+      if (out == NULL) return out; // stbi__convert_format frees input on failure
+   }
+   return out;
 }
 #endif
 
 static int stbi__info_main(stbi__context *s, int *x, int *y, int *comp)
 {
+   int f = stbi__sniff(s);
+
    #ifndef STBI_NO_JPEG
-   if (stbi__jpeg_info(s, x, y, comp)) return 1;
+   if ((f & STBI__SNIFF_JPEG) && stbi__jpeg_info(s, x, y, comp)) return 1;
    #endif
 
    #ifndef STBI_NO_PNG
-   if (stbi__png_info(s, x, y, comp))  return 1;
+   if ((f & STBI__SNIFF_PNG) && stbi__png_info(s, x, y, comp))  return 1;
    #endif
 
    #ifndef STBI_NO_GIF
-   if (stbi__gif_info(s, x, y, comp))  return 1;
+   if ((f & STBI__SNIFF_GIF) && stbi__gif_info(s, x, y, comp))  return 1;
    #endif
 
    #ifndef STBI_NO_BMP
-   if (stbi__bmp_info(s, x, y, comp))  return 1;
+   if ((f & STBI__SNIFF_BMP) && stbi__bmp_info(s, x, y, comp))  return 1;
    #endif
 
    #ifndef STBI_NO_PSD
-   if (stbi__psd_info(s, x, y, comp))  return 1;
+   if ((f & STBI__SNIFF_PSD) && stbi__psd_info(s, x, y, comp))  return 1;
    #endif
 
    #ifndef STBI_NO_PIC
-   if (stbi__pic_info(s, x, y, comp))  return 1;
+   if ((f & STBI__SNIFF_PIC) && stbi__pic_info(s, x, y, comp))  return 1;
    #endif
 
    #ifndef STBI_NO_PNM
-   if (stbi__pnm_info(s, x, y, comp))  return 1;
+   if ((f & STBI__SNIFF_PNM) && stbi__pnm_info(s, x, y, comp))  return 1;
+   #endif
+
+   #ifndef STBI_NO_QOI
+   if ((f & STBI__SNIFF_QOI) && stbi__qoi_info(s, x, y, comp))  return 1;
    #endif
 
    #ifndef STBI_NO_HDR
-   if (stbi__hdr_info(s, x, y, comp))  return 1;
+   if ((f & STBI__SNIFF_HDR) && stbi__hdr_info(s, x, y, comp))  return 1;
    #endif
 
    // test tga last because it's a crappy test!
    #ifndef STBI_NO_TGA
-   if (stbi__tga_info(s, x, y, comp))
+   if ((f & STBI__SNIFF_TGA) && stbi__tga_info(s, x, y, comp))
        return 1;
    #endif
    return stbi__err("unknown image type", "Image not of any known type, or corrupt");
@@ -6961,6 +8761,19 @@ STBIDEF int stbi_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y
    return stbi__info_main(&s,x,y,comp);
 }
 
+STBIDEF int stbi_is_16_bit_from_memory(stbi_uc const *buffer, int len)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   #ifndef STBI_NO_PNG
+   if (stbi__png_is16(&s)) return 1;
+   #endif
+   #ifndef STBI_NO_PNM
+   if (stbi__pnm_is16(&s)) return 1;
+   #endif
+   return 0;
+}
+
 STBIDEF int stbi_info_from_callbacks(stbi_io_callbacks const *c, void *user, int *x, int *y, int *comp)
 {
    stbi__context s;
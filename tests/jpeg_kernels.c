@@ -0,0 +1,147 @@
+// tests/jpeg_kernels.c
+//
+// Throughput of each JPEG IDCT and YCbCr-to-RGB kernel that stb_image can
+// dispatch to on this machine: the generic C one, SSE2 (or NEON), and AVX2.
+// Every kernel runs over the same random data for about a third of a second,
+// and its output is checked against the generic IDCT, or against the SSE2
+// colour conversion that the AVX2 one follows.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "../stb_image.h"
+
+#define NUMBLOCKS	1024			// a strip of horizontally adjacent 8x8 blocks
+#define STRIDE		( NUMBLOCKS * 8 )
+#define ROWWIDTH	8192			// pixels per colour conversion call
+#define MIN_SECONDS	0.3
+
+#if defined(STBI_NEON)
+#	define SIMDNAME	"neon"
+#else
+#	define SIMDNAME	"sse2"
+#endif
+
+static short coeffs[ NUMBLOCKS * 64 ];
+static stbi_uc pixels[ 8 * STRIDE ];
+static stbi_uc ys[ ROWWIDTH ], cbs[ ROWWIDTH ], crs[ ROWWIDTH ];
+static stbi_uc rgba[ ROWWIDTH * 4 ];
+
+
+static double now( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static void idct_generic( void )
+{
+	for ( int i=0; i<NUMBLOCKS; ++i )
+		stbi__idct_block( pixels + 8*i, STRIDE, coeffs + 64*i );
+}
+
+static void ycbcr_generic( void )
+{
+	stbi__YCbCr_to_RGB_row( rgba, ys, cbs, crs, ROWWIDTH, 4 );
+}
+
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+static void idct_simd( void )
+{
+	for ( int i=0; i<NUMBLOCKS; ++i )
+		stbi__idct_simd( pixels + 8*i, STRIDE, coeffs + 64*i );
+}
+
+static void ycbcr_simd( void )
+{
+	stbi__YCbCr_to_RGB_simd( rgba, ys, cbs, crs, ROWWIDTH, 4 );
+}
+#endif
+
+#if defined(STBI_AVX2)
+static void idct_avx2( void )
+{
+	for ( int i=0; i<NUMBLOCKS; i+=2 )
+		stbi__idct_avx2( pixels + 8*i, pixels + 8*(i+1), STRIDE, coeffs + 64*i, coeffs + 64*(i+1) );
+}
+
+static void ycbcr_avx2( void )
+{
+	stbi__YCbCr_to_RGB_avx2( rgba, ys, cbs, crs, ROWWIDTH, 4 );
+}
+#endif
+
+
+// Runs kernel until MIN_SECONDS have passed, and prints how many bytes of
+// output it made per second. If ref is given, the output has to match it.
+static int measure( const char* name, const char* variant, void (*kernel)( void ), stbi_uc* out, size_t outsize, const stbi_uc* ref )
+{
+	kernel();
+	if ( ref && memcmp( out, ref, outsize ) )
+	{
+		fprintf( stderr, "jpeg_kernels: %s %s output differs\n", name, variant );
+		return 1;
+	}
+	int runs = 0;
+	const double t0 = now();
+	double t1 = t0;
+	while ( t1 - t0 < MIN_SECONDS )
+	{
+		kernel();
+		++runs;
+		t1 = now();
+	}
+	printf( "%-14s %-8s %10.1f MB/s\n", name, variant, (double) outsize * runs / ( t1 - t0 ) / 1e6 );
+	return 0;
+}
+
+
+int main( void )
+{
+	static stbi_uc idctref[ sizeof( pixels ) ];
+	static stbi_uc ycbcrref[ sizeof( rgba ) ];
+	int failures = 0;
+
+	// Coefficients shrink with frequency, roughly as in dequantized photos.
+	srand( 1 );
+	for ( int i=0; i<NUMBLOCKS*64; ++i )
+	{
+		const int range = 1024 / ( 1 + i % 64 );
+		coeffs[ i ] = (short) ( rand() % ( 2*range + 1 ) - range );
+	}
+	for ( int i=0; i<ROWWIDTH; ++i )
+	{
+		ys[ i ] = (stbi_uc) rand();
+		cbs[ i ] = (stbi_uc) rand();
+		crs[ i ] = (stbi_uc) rand();
+	}
+
+	failures += measure( "idct", "generic", idct_generic, pixels, sizeof( pixels ), 0 );
+	memcpy( idctref, pixels, sizeof( pixels ) );
+	failures += measure( "ycbcr-to-rgb", "generic", ycbcr_generic, rgba, sizeof( rgba ), 0 );
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+#	if defined(STBI_SSE2)
+	if ( stbi__sse2_available() )
+#	endif
+	{
+		failures += measure( "idct", SIMDNAME, idct_simd, pixels, sizeof( pixels ), idctref );
+		failures += measure( "ycbcr-to-rgb", SIMDNAME, ycbcr_simd, rgba, sizeof( rgba ), 0 );
+		memcpy( ycbcrref, rgba, sizeof( rgba ) );
+	}
+#endif
+#if defined(STBI_AVX2)
+	if ( stbi__sse2_available() && stbi__avx2_available() )
+	{
+		failures += measure( "idct", "avx2", idct_avx2, pixels, sizeof( pixels ), idctref );
+		failures += measure( "ycbcr-to-rgb", "avx2", ycbcr_avx2, rgba, sizeof( rgba ), ycbcrref );
+	}
+	else
+		printf( "avx2 kernels: not supported by this CPU\n" );
+#endif
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,139 @@
+// tests/neon/arm_neon.h
+//
+// Scalar models of the NEON intrinsics used by stb_image's PNG unfilter, so
+// tests/unfilter.c can compile and check that branch on machines without
+// NEON. Only what the PNG code uses is here, following ARM's definitions,
+// with lanes in memory order as on little-endian ARM.
+
+#ifndef TESTS_NEON_ARM_NEON_H
+#define TESTS_NEON_ARM_NEON_H
+
+#include <stdint.h>
+#include <string.h>
+
+typedef struct { uint8_t v[ 8 ]; } uint8x8_t;
+typedef struct { uint32_t v[ 2 ]; } uint32x2_t;
+typedef struct { uint16_t v[ 8 ]; } uint16x8_t;
+typedef struct { int16_t v[ 8 ]; } int16x8_t;
+
+static inline uint32x2_t vdup_n_u32( uint32_t x )
+{
+	uint32x2_t r = { { x, x } };
+	return r;
+}
+
+static inline uint8x8_t vdup_n_u8( uint8_t x )
+{
+	uint8x8_t r;
+	memset( r.v, x, 8 );
+	return r;
+}
+
+static inline uint8x8_t vreinterpret_u8_u32( uint32x2_t x )
+{
+	uint8x8_t r;
+	memcpy( r.v, x.v, 8 );
+	return r;
+}
+
+static inline uint32x2_t vreinterpret_u32_u8( uint8x8_t x )
+{
+	uint32x2_t r;
+	memcpy( r.v, x.v, 8 );
+	return r;
+}
+
+static inline int16x8_t vreinterpretq_s16_u16( uint16x8_t x )
+{
+	int16x8_t r;
+	memcpy( r.v, x.v, 16 );
+	return r;
+}
+
+static inline uint16x8_t vreinterpretq_u16_s16( int16x8_t x )
+{
+	uint16x8_t r;
+	memcpy( r.v, x.v, 16 );
+	return r;
+}
+
+static inline uint32_t vget_lane_u32( uint32x2_t x, int lane )
+{
+	return x.v[ lane ];
+}
+
+static inline uint8x8_t vset_lane_u8( uint8_t a, uint8x8_t x, int lane )
+{
+	x.v[ lane ] = a;
+	return x;
+}
+
+#define NEON_MAP8( name, expr ) \
+static inline uint8x8_t name( uint8x8_t a, uint8x8_t b ) \
+{ \
+	uint8x8_t r; \
+	for ( int i=0; i<8; ++i ) r.v[ i ] = (uint8_t) ( expr ); \
+	return r; \
+}
+NEON_MAP8( vadd_u8, a.v[ i ] + b.v[ i ] )
+NEON_MAP8( vorr_u8, a.v[ i ] | b.v[ i ] )
+NEON_MAP8( vhadd_u8, ( a.v[ i ] + b.v[ i ] ) >> 1 )
+#undef NEON_MAP8
+
+static inline uint8x8_t vbsl_u8( uint8x8_t m, uint8x8_t a, uint8x8_t b )
+{
+	uint8x8_t r;
+	for ( int i=0; i<8; ++i ) r.v[ i ] = (uint8_t) ( ( m.v[ i ] & a.v[ i ] ) | ( ~m.v[ i ] & b.v[ i ] ) );
+	return r;
+}
+
+static inline uint16x8_t vabdl_u8( uint8x8_t a, uint8x8_t b )
+{
+	uint16x8_t r;
+	for ( int i=0; i<8; ++i ) r.v[ i ] = (uint16_t) ( a.v[ i ] > b.v[ i ] ? a.v[ i ] - b.v[ i ] : b.v[ i ] - a.v[ i ] );
+	return r;
+}
+
+static inline uint16x8_t vsubl_u8( uint8x8_t a, uint8x8_t b )
+{
+	uint16x8_t r;
+	for ( int i=0; i<8; ++i ) r.v[ i ] = (uint16_t) ( a.v[ i ] - b.v[ i ] );
+	return r;
+}
+
+static inline int16x8_t vaddq_s16( int16x8_t a, int16x8_t b )
+{
+	int16x8_t r;
+	for ( int i=0; i<8; ++i ) r.v[ i ] = (int16_t) (uint16_t) ( a.v[ i ] + b.v[ i ] );
+	return r;
+}
+
+static inline int16x8_t vabsq_s16( int16x8_t a )
+{
+	int16x8_t r;
+	for ( int i=0; i<8; ++i ) r.v[ i ] = (int16_t) (uint16_t) ( a.v[ i ] < 0 ? -a.v[ i ] : a.v[ i ] );
+	return r;
+}
+
+static inline uint16x8_t vminq_u16( uint16x8_t a, uint16x8_t b )
+{
+	uint16x8_t r;
+	for ( int i=0; i<8; ++i ) r.v[ i ] = a.v[ i ] < b.v[ i ] ? a.v[ i ] : b.v[ i ];
+	return r;
+}
+
+static inline uint16x8_t vceqq_u16( uint16x8_t a, uint16x8_t b )
+{
+	uint16x8_t r;
+	for ( int i=0; i<8; ++i ) r.v[ i ] = a.v[ i ] == b.v[ i ] ? 0xffff : 0;
+	return r;
+}
+
+static inline uint8x8_t vmovn_u16( uint16x8_t a )
+{
+	uint8x8_t r;
+	for ( int i=0; i<8; ++i ) r.v[ i ] = (uint8_t) a.v[ i ];
+	return r;
+}
+
+#endif
@@ -0,0 +1,184 @@
+// tests/stress.c
+//
+// Decodes a set of images on many threads at once, each thread with its own
+// flip and reduce settings, and checks every result and failure reason against
+// a decode of the same image with the same settings done up front on one
+// thread. A truncated copy of each image and a buffer of garbage are decoded
+// as well, so failures race with successes.
+//
+// Usage: stress image [image2 .. imageN]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define STBI_THREADS
+#define STB_IMAGE_IMPLEMENTATION
+#include "../stb_image.h"
+
+#define NUMTHREADS	16
+#define ROUNDS		3
+#define SETTINGS	8	// flip on or off, times reduce shift 0..3
+
+typedef struct
+{
+	const char* name;
+	unsigned char* data;
+	int size;
+} entry_t;
+
+typedef struct
+{
+	unsigned long long hash;	// of the size and pixels, or of the failure reason
+	int ok;
+} result_t;
+
+static entry_t* entries;
+static int numentries;
+static result_t* reference;		// [ setting * numentries + entry ]
+
+
+static unsigned long long fnv( unsigned long long h, const void* p, size_t n )
+{
+	const unsigned char* b = (const unsigned char*) p;
+	for ( size_t i=0; i<n; ++i )
+		h = ( h ^ b[ i ] ) * 0x100000001b3ULL;
+	return h;
+}
+
+
+// Loads entry e with the calling thread's settings, as they are set to setting s.
+static result_t decode( int e, int s )
+{
+	result_t r;
+	int w=0, h=0, n=0;
+	stbi_set_flip_vertically_on_load_thread( s & 1 );
+	stbi_set_reduce_on_load_thread( s >> 1 );
+	unsigned char* pixels = stbi_load_from_memory( entries[ e ].data, entries[ e ].size, &w, &h, &n, 0 );
+	r.ok = pixels != 0;
+	r.hash = 0xcbf29ce484222325ULL;
+	if ( pixels )
+	{
+		const int dims[ 3 ] = { w, h, n };
+		r.hash = fnv( r.hash, dims, sizeof( dims ) );
+		r.hash = fnv( r.hash, pixels, (size_t) w * h * n );
+		stbi_image_free( pixels );
+	}
+	else
+	{
+		const char* reason = stbi_failure_reason();
+		r.hash = fnv( r.hash, reason, strlen( reason ) );
+	}
+	return r;
+}
+
+
+static void* worker( void* arg )
+{
+	const int t = (int) (size_t) arg;
+	const int s = t % SETTINGS;
+	int* mismatches = (int*) calloc( 1, sizeof( int ) );
+	for ( int round=0; round<ROUNDS; ++round )
+		for ( int i=0; i<numentries; ++i )
+		{
+			// Each thread starts at a different image, so all of them are in flight at once.
+			const int e = ( i + t ) % numentries;
+			const result_t r = decode( e, s );
+			const result_t* want = reference + s * numentries + e;
+			if ( r.ok != want->ok || r.hash != want->hash )
+			{
+				fprintf( stderr, "stress: thread %d, %s with flip %d reduce %d: %s\n", t, entries[ e ].name, s & 1, s >> 1, r.ok ? "pixels differ" : stbi_failure_reason() );
+				++*mismatches;
+			}
+		}
+	return mismatches;
+}
+
+
+static unsigned char* read_file( const char* name, int* size )
+{
+	FILE* f = fopen( name, "rb" );
+	if ( !f )
+		return 0;
+	fseek( f, 0, SEEK_END );
+	const long len = ftell( f );
+	fseek( f, 0, SEEK_SET );
+	unsigned char* data = (unsigned char*) malloc( len > 0 ? len : 1 );
+	if ( len < 0 || fread( data, 1, len, f ) != (size_t) len )
+	{
+		free( data );
+		fclose( f );
+		return 0;
+	}
+	fclose( f );
+	*size = (int) len;
+	return data;
+}
+
+
+int main( int argc, char* argv[] )
+{
+	if ( argc < 2 )
+	{
+		fprintf( stderr, "Usage: %s image [image2 .. imageN]\n", argv[0] );
+		return 1;
+	}
+
+	static unsigned char garbage[ 256 ];
+	for ( int i=0; i<(int)sizeof( garbage ); ++i )
+		garbage[ i ] = (unsigned char) ( i * 37 + 11 );
+	entries = (entry_t*) calloc( 2 * ( argc - 1 ) + 1, sizeof( entry_t ) );
+	for ( int i=1; i<argc; ++i )
+	{
+		entry_t* e = entries + numentries;
+		e->name = argv[ i ];
+		e->data = read_file( argv[ i ], &e->size );
+		if ( !e->data )
+		{
+			fprintf( stderr, "stress: cannot read %s\n", argv[ i ] );
+			return 1;
+		}
+		// The same image cut off halfway.
+		e[ 1 ] = e[ 0 ];
+		e[ 1 ].size /= 2;
+		numentries += 2;
+	}
+	entries[ numentries ].name = "garbage";
+	entries[ numentries ].data = garbage;
+	entries[ numentries ].size = (int) sizeof( garbage );
+	numentries++;
+
+	reference = (result_t*) malloc( SETTINGS * numentries * sizeof( result_t ) );
+	int failures = 0;
+	for ( int s=0; s<SETTINGS; ++s )
+		for ( int e=0; e<numentries; ++e )
+		{
+			reference[ s * numentries + e ] = decode( e, s );
+			failures += !reference[ s * numentries + e ].ok;
+		}
+
+	pthread_t threads[ NUMTHREADS ];
+	for ( int t=0; t<NUMTHREADS; ++t )
+		if ( pthread_create( threads + t, 0, worker, (void*) (size_t) t ) )
+		{
+			fprintf( stderr, "stress: cannot start thread %d\n", t );
+			return 1;
+		}
+	int mismatches = 0;
+	for ( int t=0; t<NUMTHREADS; ++t )
+	{
+		void* ret = 0;
+		pthread_join( threads[ t ], &ret );
+		mismatches += *(int*) ret;
+		free( ret );
+	}
+
+	if ( mismatches )
+	{
+		fprintf( stderr, "stress: %d decodes differ from the single-threaded ones\n", mismatches );
+		return 1;
+	}
+	printf( "stress: %d threads x %d rounds of %d images (%d failing) match the single-threaded decodes\n", NUMTHREADS, ROUNDS, numentries, failures / SETTINGS );
+	return 0;
+}
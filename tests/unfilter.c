@@ -0,0 +1,121 @@
+// tests/unfilter.c
+//
+// Differential test of the SIMD PNG unfilter against the scalar loops: random
+// 8-bit RGB and RGBA rows, under all five filters, with and without RGB being
+// expanded to RGBA, have to come out the same both ways.
+//
+// Built with -DNEON_SHIM and tests/neon on the include path, the NEON branch is
+// compiled instead of SSE2, against a scalar model of its intrinsics, so it
+// is checked on x86 too. On ARM the plain build checks the real NEON code.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <assert.h>
+
+#if defined(NEON_SHIM)
+// The system headers are all in by now, so hiding the x86 target from
+// stb_image only changes which of its SIMD branches gets compiled.
+#	undef __x86_64__
+#	undef __i386
+#	define STBI_NEON
+#elif defined(__ARM_NEON)
+#	define STBI_NEON
+#endif
+#define STBI_NO_JPEG	// its NEON code needs more than tests/neon models
+#define STB_IMAGE_IMPLEMENTATION
+#include "../stb_image.h"
+
+#if defined(STBI_NEON)
+static const char* branch = "neon";
+#elif defined(STBI_SSE2)
+static const char* branch = "sse2";
+#else
+static const char* branch = 0;
+#endif
+
+#define MAXW	67	// widths 1..MAXW cover every pixel count modulo the vector loops
+#define ROWS	6
+#define TRIALS	8
+
+static unsigned int seed = 1;
+
+static int rnd( void )
+{
+	seed = seed * 1103515245u + 12345u;
+	return ( seed >> 16 ) & 0x7fff;
+}
+
+
+// Unfilters rows of raw (each a filter byte and width*img_n bytes) into out,
+// which has a spare row in front, as the decoder's prior row pointer expects.
+static void unfilter( stbi_uc* out, stbi_uc* raw, int width, int img_n, int out_n, int simd )
+{
+	stbi__context s;
+	stbi__png p;
+	memset( &s, 0, sizeof( s ) );
+	memset( &p, 0, sizeof( p ) );
+	s.img_n = img_n;
+	p.s = &s;
+	p.out = out + width * out_n;
+	p.depth = 8;
+	p.simd = simd;
+	for ( int j=0; j<ROWS; ++j )
+		if ( !stbi__png_unfilter_row( &p, raw + j * ( 1 + width * img_n ), j, out_n, width, 8 ) )
+		{
+			fprintf( stderr, "unfilter: %s\n", stbi_failure_reason() );
+			exit( 1 );
+		}
+}
+
+
+int main( void )
+{
+	static const int layouts[][2] = { { 3, 3 }, { 3, 4 }, { 4, 4 } };	// img_n, out_n
+	static const char* filters[] = { "none", "sub", "up", "avg", "paeth" };
+	static stbi_uc raw[ ROWS * ( 1 + MAXW * 4 ) ];
+	static stbi_uc scalar[ ( ROWS + 1 ) * MAXW * 4 ];
+	static stbi_uc simd[ ( ROWS + 1 ) * MAXW * 4 ];
+	int failures = 0, rows = 0;
+
+	if ( !branch )
+	{
+		printf( "unfilter: no SIMD branch compiled in, nothing to compare\n" );
+		return 0;
+	}
+
+	for ( int l=0; l<3; ++l )
+		for ( int f=0; f<5; ++f )
+			for ( int width=1; width<=MAXW; ++width )
+				for ( int t=0; t<TRIALS; ++t )
+				{
+					const int img_n = layouts[ l ][ 0 ];
+					const int out_n = layouts[ l ][ 1 ];
+					const int rowbytes = 1 + width * img_n;
+					for ( int i=0; i<ROWS*rowbytes; ++i )
+						raw[ i ] = (stbi_uc) rnd();
+					// The last trial mixes filters from row to row.
+					for ( int j=0; j<ROWS; ++j )
+						raw[ j * rowbytes ] = (stbi_uc) ( t == TRIALS-1 ? rnd() % 5 : f );
+					memset( scalar, 0xa5, sizeof( scalar ) );
+					memset( simd, 0xa5, sizeof( simd ) );
+					unfilter( scalar, raw, width, img_n, out_n, 0 );
+					unfilter( simd, raw, width, img_n, out_n, 1 );
+					rows += ROWS;
+					if ( memcmp( scalar, simd, sizeof( scalar ) ) && failures++ < 10 )
+						fprintf( stderr, "unfilter: %s differs from scalar: %s, img_n %d, out_n %d, width %d, trial %d\n", branch, filters[ f ], img_n, out_n, width, t );
+				}
+
+	if ( failures )
+	{
+		fprintf( stderr, "unfilter: %s: %d of %d cases differ\n", branch, failures, rows / ROWS );
+		return 1;
+	}
+	printf( "unfilter: %s matches scalar on %d rows\n", branch, rows );
+	return 0;
+}
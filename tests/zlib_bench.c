@@ -0,0 +1,133 @@
+// tests/zlib_bench.c
+//
+// Inflate throughput of stb_image's zlib decoder. The zlib stream of each PNG
+// given (its IDAT chunks, joined) is inflated with stbi_zlib_decode_malloc
+// over and over for about half a second, and the inflated bytes per second
+// are reported per file and in total. Files that aren't PNG are skipped.
+//
+// Usage: zlib_bench image.png [image2.png .. imageN.png]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "../stb_image.h"
+
+#define MIN_SECONDS	0.5
+
+
+static double now( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static unsigned int be32( const unsigned char* p )
+{
+	return (unsigned int) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+
+// Joins the IDAT chunks of the PNG in data into one zlib stream, or returns 0.
+static unsigned char* png_zlib_stream( const unsigned char* data, size_t size, int* len )
+{
+	static const unsigned char sig[ 8 ] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	if ( size < 8 || memcmp( data, sig, 8 ) )
+		return 0;
+	unsigned char* z = (unsigned char*) malloc( size );
+	size_t pos = 8, n = 0;
+	while ( pos + 12 <= size )
+	{
+		const size_t chunklen = be32( data + pos );
+		if ( chunklen > size - pos - 12 )
+			break;
+		if ( !memcmp( data + pos + 4, "IDAT", 4 ) )
+		{
+			memcpy( z + n, data + pos + 8, chunklen );
+			n += chunklen;
+		}
+		pos += chunklen + 12;
+	}
+	*len = (int) n;
+	return z;
+}
+
+
+static unsigned char* read_file( const char* name, size_t* size )
+{
+	FILE* f = fopen( name, "rb" );
+	if ( !f )
+		return 0;
+	fseek( f, 0, SEEK_END );
+	const long len = ftell( f );
+	fseek( f, 0, SEEK_SET );
+	unsigned char* data = (unsigned char*) malloc( len > 0 ? len : 1 );
+	if ( len < 0 || fread( data, 1, len, f ) != (size_t) len )
+	{
+		free( data );
+		fclose( f );
+		return 0;
+	}
+	fclose( f );
+	*size = (size_t) len;
+	return data;
+}
+
+
+int main( int argc, char* argv[] )
+{
+	double totalbytes = 0, totalseconds = 0;
+	int files = 0;
+
+	if ( argc < 2 )
+	{
+		fprintf( stderr, "Usage: %s image.png [image2.png .. imageN.png]\n", argv[0] );
+		return 1;
+	}
+	for ( int i=1; i<argc; ++i )
+	{
+		size_t size = 0;
+		int zlen = 0, outlen = 0;
+		unsigned char* data = read_file( argv[ i ], &size );
+		unsigned char* z = data ? png_zlib_stream( data, size, &zlen ) : 0;
+		free( data );
+		if ( !z )
+			continue;
+
+		// One untimed run to check the stream and warm the caches.
+		char* out = stbi_zlib_decode_malloc( (const char*) z, zlen, &outlen );
+		if ( !out )
+		{
+			fprintf( stderr, "zlib_bench: %s: %s\n", argv[ i ], stbi_failure_reason() );
+			return 1;
+		}
+		stbi_image_free( out );
+
+		int runs = 0;
+		const double t0 = now();
+		double t1 = t0;
+		while ( t1 - t0 < MIN_SECONDS )
+		{
+			stbi_image_free( stbi_zlib_decode_malloc( (const char*) z, zlen, &outlen ) );
+			++runs;
+			t1 = now();
+		}
+		free( z );
+		const double bytes = (double) outlen * runs;
+		printf( "%-40s %9d -> %10d bytes %8.1f MB/s\n", argv[ i ], zlen, outlen, bytes / ( t1 - t0 ) / 1e6 );
+		totalbytes += bytes;
+		totalseconds += t1 - t0;
+		files++;
+	}
+	if ( !files )
+	{
+		fprintf( stderr, "zlib_bench: no PNG files given\n" );
+		return 1;
+	}
+	printf( "%-40s %40.1f MB/s\n", "total", totalbytes / totalseconds / 1e6 );
+	return 0;
+}